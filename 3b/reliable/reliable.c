@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <assert.h>
+#include <math.h>
 #include <poll.h>
 #include <errno.h>
 #include <time.h>
@@ -15,68 +16,162 @@
 
 #include "rlib.h"
 
-#define ACK_SIZE 12
-#define PACKET_SIZE 1016
-#define HEADER_SIZE 16
-#define MSS 1000
-#define TIMEOUT 100
+#define ACK_SIZE 16
+#define SACK_ACK_SIZE 19	// an ack followed by its SACK bitmap
+#define DUPTHRESH 3		// SACKed packets above a hole that make it lost (RFC 6675)
+#define PACKET_SIZE 1016	// largest datagram the relayer passes on whole
+#define HEADER_SIZE 20
+#define MSS 996
+#define RCVBUF_INIT 25		// initial receive buffer, in packets; autotuned up to cc->window
+#define PACE_SLACK_US 1000	// how far behind schedule pacing may catch up in one burst, at least
+#define PACE_SS_RATIO 200	// percent of cwnd/srtt -p paces at in slow start, as in Linux
+#define PACE_CA_RATIO 120	// and after it
 
 /* ===== Structs ===== */
+// Kinds of loss a congestion control algorithm is told about
+enum cc_loss {
+	CC_LOSS_DUPACK,			// fast retransmit, entering recovery
+	CC_LOSS_TIMEOUT,		// retransmission timeout
+};
+
+// What an ack tells congestion control, including a delivery-rate sample
+// (draft-cheng-iccrg-delivery-rate-estimation, Linux's struct rate_sample):
+// `delivered` packets reached the receiver over `interval_us`
+struct rate_sample {
+	uint32_t acked;                   // packets newly acked cumulatively
+	uint32_t newly_delivered;         // packets delivered by this ack, SACKs included
+	uint32_t prior_flight;            // packets outstanding before the ack
+	long rtt_us;                      // RTT sample, or -1 (Karn's rule)
+	uint32_t owd_us;                  // one-way delay the ack reports (struct ack_packet), 0 if none
+	uint32_t prior_delivered;         // s_delivered when the newest delivered packet was sent
+	uint32_t delivered;               // packets delivered since then
+	long interval_us;                 // over how long; 0 if there is no rate sample
+	int app_limited;                  // the sender was short of data at the time
+};
+
+// The sender's delivery-rate state as a packet leaves, kept per ring slot
+struct tx_rate {
+	uint32_t delivered;               // s_delivered
+	int app_limited;                  // s_app_limited was set
+	struct timespec delivered_time;   // s_delivered_time
+	struct timespec first_sent;       // s_first_sent
+};
+
+// A congestion control algorithm.  Loss detection and recovery decide when
+// packets are lost and which to resend; the algorithm only decides cwnd,
+// ssthresh and, if it paces, the sending rate.  Its state lives in
+// s_cc_priv.
+struct cc_ops {
+	const char *name;			// selected with --cc=name
+	void (*init)(rel_t *r);
+	// an ack delivered packets, moving the cumulative ack or SACKing new ones
+	void (*on_ack)(rel_t *r, const struct rate_sample *rs);
+	// a loss was detected; must set s_ssthresh and s_cwnd
+	void (*on_loss)(rel_t *r, enum cc_loss kind);
+	// optional: a data packet was (re)transmitted
+	void (*on_send)(rel_t *r, uint32_t seqno);
+	// optional: bytes per second to pace at, 0 to send as fast as cwnd allows
+	uint64_t (*pacing_rate)(rel_t *r);
+};
+
 struct reliable_state {
 
 	conn_t *c;			/* This is the connection object */
 
 	/* Add your own data fields below this */
-	struct timespec *start;
+	struct timespec start;
 
 	// sender's view
 	uint32_t s_next_out_pkt_seq;      // seqno of next packet to send
+	uint32_t s_next_tx_seq;           // seqno of next packet to transmit; rewound on a timeout
+	uint32_t s_max_tx_seq;            // one past the highest seqno ever transmitted
 	uint32_t s_last_ack_recvd;        // seqno of last packet acked
 	uint32_t s_cwnd;						  // congestion window(based on timeout, acks, etc.)
 	uint32_t s_rwnd;						  // what receiver says window should be window 
-	int s_ssthresh; 		// slow start threshold 
-	int s_dup_acks;					  // currently recovering from dup acks
+	uint32_t s_ssthresh; 		// slow start threshold 
+	const struct cc_ops *s_cc;        // congestion control algorithm
+	uint64_t s_cc_priv[32];           // private state of the algorithm, e.g. struct reno
 	int s_dup_ack_count;			  // keeps track of how many duplicate acks so far 
-	int s_dup_acks_reset;			  // dup ack discovered
-	int s_timeout;					  // currently recovering from time out
-	int s_timeout_reset;				  // time out discovered
+	int s_in_recovery;                // 1 while in fast recovery
+	uint32_t s_recover;               // s_max_tx_seq when recovery or the last timeout began (RFC 6582)
+	uint32_t s_high_sacked;           // one past the highest SACKed packet, at least s_last_ack_recvd
+	uint32_t s_high_rxt;              // holes below this were retransmitted in this recovery
+	struct timespec s_rto_restart;    // when an ack of new data last restarted the timer
+	int s_rto_frozen;                 // 1 once a partial ack has restarted it in this recovery
 	int send_eof;                // 1 if we have sent eof
 
 	// receiver's view
 	uint32_t r_next_exp_seq;            // seqno of next expected packet
-	uint32_t r_to_print_pkt_seq;        // when rel_output is called this is the pkt it tries to grab from in_pkt_list
+	uint32_t r_to_print_pkt_seq;        // when rel_output is called this is the pkt it tries to output
 	int recv_eof;                  // 1 if we have received eof
+	uint32_t r_owd_us;                  // one-way delay of the last data packet, for acks to report
+
+	// receiver's reassembly buffer: a ring indexed by seqno & r_ring_mask holding
+	// in-order packets waiting for output (r_to_print_pkt_seq .. r_next_exp_seq-1)
+	// and out-of-order packets beyond them; r_present has a bit per filled slot
+	uint32_t r_ring_mask;
+	packet_t **r_ring_pkt;            // packet received in each slot
+	uint16_t *r_ring_len;             // payload bytes of each packet
+	uint64_t *r_present;              // bitmap of filled slots
+	uint16_t r_progress;              // bytes of r_to_print_pkt_seq already output
+
+	// receive buffer autotuning, after Linux's tcp_rcv_space_adjust: r_rcvbuf
+	// grows to twice what gets delivered per RTT, up to r_rcvbuf_max
+	uint32_t r_rcvbuf;                // packets we are willing to hold
+	uint32_t r_rcvbuf_max;            // cap on r_rcvbuf (cc->window)
+	uint32_t r_rtt_seq;               // RTT measurement ends when this seqno arrives (0: idle)
+	struct timespec r_rtt_time;       // when that measurement started
+	long r_rtt_us;                    // receiver's estimate of the RTT
+	uint32_t r_space_seq;             // r_to_print_pkt_seq at the start of this RTT
+	struct timespec r_space_time;     // start of this RTT
 
 	// Copied from config_common
-	int timeout;            // Retransmission timeout in milliseconds	
+	uint32_t s_sndbuf;      // Most packets queued or in flight before input is paused
+	long s_rto_min_us;      // Bounds on the retransmission timeout
+	long s_rto_max_us;
+
+	// RTT estimation (Jacobson/Karels, RFC 6298).  Only packets transmitted
+	// exactly once give samples (Karn's rule).
+	long s_srtt_us;                   // smoothed RTT, 0 until the first sample
+	long s_rttvar_us;                 // RTT variation
+	long s_rto_us;                    // retransmission timeout from the estimate
+	int s_rto_backoff;                // timer expiries since the last valid RTT sample
+
+	// sender's retransmission queue: a ring indexed by seqno & s_ring_mask holding
+	// packets s_last_ack_recvd .. s_next_out_pkt_seq-1, kept as separate arrays
+	// so timeout scans only touch the timestamps
+	uint32_t s_ring_mask;
+	packet_t **s_ring_pkt;            // packet sent in each slot
+	uint16_t *s_ring_size;            // UDP length of each packet
+	struct timespec *s_ring_sent;     // time of last send attempt of each packet
+	uint8_t *s_ring_retx;             // non-zero once a packet has been retransmitted
+	uint8_t *s_ring_sacked;           // non-zero once the receiver has SACKed a packet
+	struct tx_rate *s_ring_rate;      // delivery-rate state when each packet was last sent
+
+	// delivery-rate estimation: every packet sent records how much had been
+	// delivered by then, and its delivery turns that into a rate sample
+	uint32_t s_delivered;             // packets delivered, cumulatively or by SACK
+	struct timespec s_delivered_time; // when s_delivered last grew
+	struct timespec s_first_sent;     // send time of the packet that began the sample
+	uint32_t s_app_limited;           // s_delivered at which a shortage of data ends, 0 if none
+
+	// pacing, at the algorithm's pacing_rate or, with -p, at cwnd/srtt
+	int s_pace;                       // 1 to pace algorithms without a pacing_rate
+	uint32_t s_pace_burst;            // packets pacing may send back to back
+	struct timespec s_pace_next;      // the next packet may not leave before this
+	int s_pace_blocked;               // 1 if pacing is holding back a packet
+
+	rel_t *next;                      // linked list of connections
+	rel_t **prev;
 };
-rel_t *rel_list;
-
-// Struct for packets sent out and waiting for acks
-typedef struct out_pkt {
-	rel_t *r;                   // rel_t associated with this packet
-	packet_t *pkt;              // packet that was sent
-	uint32_t seqno;             // pkt->seqno
-	size_t size;                // UDP length of pkt
-	struct timespec *last_try;  // timespec of last send attempt
-	struct out_pkt *next;       // linked list node
-} out_pkt_t;
-
-// struct for packets that recieved but should not be printed due to previous missing packets
-typedef struct in_pkt {
-	rel_t *r;                   // rel_t associated with this packet
-	packet_t *pkt;              // packet that was received
-	uint32_t seqno;             // pkt->seqno
-	size_t size;                // UDP length of pkt
-	uint16_t progress;		 	// progress (bytes) made in outputting
-	uint16_t len;				// length (bytes) for outputting
-	struct in_pkt *next;        // linked list node
-} in_pkt_t;
 
 /* ===== Global variables ===== */
 rel_t *rel_list;
-out_pkt_t *out_list_head = NULL;
-in_pkt_t *in_list_head = NULL;
+
+/* ===== Prototypes ===== */
+void read_input (rel_t *s);
+void output_data (rel_t *r);
+int is_present(rel_t* r, uint32_t seqno);
 
 /* ===== Functions ===== */
 /* From https://tint2.googlecode.com/svn/trunk/src/util/timer.c */
@@ -114,122 +209,1238 @@ uint32_t min32(uint32_t a, uint32_t b) {
 	return b;
 }
 
+// Microseconds from a to b
+long timespec_diff_us(const struct timespec *a, const struct timespec *b) {
+	return (b->tv_sec - a->tv_sec) * 1000000 + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+// Moves t by ns nanoseconds, either way
+void timespec_add_ns(struct timespec *t, long ns) {
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec += ns % 1000000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+	else if (t->tv_nsec < 0) {
+		t->tv_sec--;
+		t->tv_nsec += 1000000000;
+	}
+}
+
+// Microseconds on the clock t was read from, as carried in tsval
+uint32_t timestamp_us(const struct timespec *t) {
+	return t->tv_sec * 1000000 + t->tv_nsec / 1000;
+}
+
+// Window to advertise: the part of the receive buffer not taken up by packets
+// that are in order but still waiting for room in the output queue
+uint32_t recv_window(rel_t* r) {
+	uint32_t held = r->r_next_exp_seq - r->r_to_print_pkt_seq;
+
+	if (held >= r->r_rcvbuf)
+		return 0;
+	return r->r_rcvbuf - held;
+}
+
 void send_ack(rel_t* r) {
+	uint32_t seqno;
+	int i, size = ACK_SIZE;
+
 	//Construct ack
 	struct ack_packet sent_ack;
 	sent_ack.cksum = 0x0000;
-	sent_ack.len = htons(ACK_SIZE);
 	sent_ack.ackno = htonl(r->r_next_exp_seq);
-	sent_ack.rwnd = htonl(25);//sent_ack.rwnd = htonl(conn_bufspace(r->c)/MSS);
-	sent_ack.cksum = cksum ((void*) &sent_ack, ACK_SIZE);
+	sent_ack.rwnd = htonl(recv_window(r));
+	sent_ack.delay = htonl(r->r_owd_us);
+
+	// SACK the out-of-order packets just past the cumulative ack; the bitmap is
+	// only sent when there is a hole to report
+	memset(sent_ack.sack, 0, sizeof(sent_ack.sack));
+	for (i = 0; i < SACK_BITS; i++) {
+		seqno = r->r_next_exp_seq + 1 + i;
+		if (seqno - r->r_to_print_pkt_seq > r->r_ring_mask)
+			break;
+		if (is_present(r, seqno)) {
+			sent_ack.sack[i / 8] |= 1 << (i % 8);
+			size = SACK_ACK_SIZE;
+		}
+	}
+
+	sent_ack.len = htons(size);
+	sent_ack.cksum = cksum ((void*) &sent_ack, size);
 
 	//Send ack
-	conn_sendpkt (r->c, (packet_t*) &sent_ack, ACK_SIZE);
+	conn_sendpkt (r->c, (packet_t*) &sent_ack, size);
+}
+
+//Allocates the retransmission ring with size slots (a power of two)
+void init_send_ring(rel_t* r, uint32_t size) {
+	r->s_ring_mask = size - 1;
+	r->s_ring_pkt = (packet_t**) xmalloc(size * sizeof(packet_t*));
+	r->s_ring_size = (uint16_t*) xmalloc(size * sizeof(uint16_t));
+	r->s_ring_sent = (struct timespec*) xmalloc(size * sizeof(struct timespec));
+	r->s_ring_retx = (uint8_t*) xmalloc(size * sizeof(uint8_t));
+	r->s_ring_sacked = (uint8_t*) xmalloc(size * sizeof(uint8_t));
+	r->s_ring_rate = (struct tx_rate*) xmalloc(size * sizeof(struct tx_rate));
+}
+
+//Queues the packet with seqno s_next_out_pkt_seq in the retransmission ring
+void add_to_send_ring(rel_t* r, packet_t *pkt, size_t size) {
+	uint32_t slot = r->s_next_out_pkt_seq & r->s_ring_mask;
+
+	r->s_ring_pkt[slot] = pkt;
+	r->s_ring_size[slot] = size;
+	r->s_ring_retx[slot] = 0;
+	r->s_ring_sacked[slot] = 0;
+}
+
+//Snapshots the delivery-rate state into the packet in slot as it is sent at
+//now.  A send with nothing outstanding starts afresh, there being no acks to
+//time the sample against.
+void rate_on_send(rel_t* r, uint32_t slot, const struct timespec *now) {
+	struct tx_rate *tx = &r->s_ring_rate[slot];
+
+	if (r->s_max_tx_seq == r->s_last_ack_recvd) {
+		r->s_first_sent = *now;
+		r->s_delivered_time = *now;
+	}
+	tx->delivered = r->s_delivered;
+	tx->app_limited = r->s_app_limited != 0;
+	tx->delivered_time = r->s_delivered_time;
+	tx->first_sent = r->s_first_sent;
+}
+
+//Counts packet seqno as delivered at now.  The ack's rate sample runs from
+//when the most recently sent of the packets it delivers was sent: over the
+//longer of the time it took to send and to ack what was delivered since.
+void rate_on_delivered(rel_t* r, struct rate_sample *rs, uint32_t seqno,
+		const struct timespec *now) {
+	uint32_t slot = seqno & r->s_ring_mask;
+	struct tx_rate *tx = &r->s_ring_rate[slot];
+	long send_us, ack_us;
+
+	r->s_delivered++;
+	r->s_delivered_time = *now;
+	if (rs->newly_delivered++ == 0 || tx->delivered - rs->prior_delivered < 0x80000000) {
+		send_us = timespec_diff_us(&tx->first_sent, &r->s_ring_sent[slot]);
+		ack_us = timespec_diff_us(&tx->delivered_time, now);
+		rs->prior_delivered = tx->delivered;
+		rs->interval_us = send_us > ack_us ? send_us : ack_us;
+		rs->app_limited = tx->app_limited;
+		r->s_first_sent = r->s_ring_sent[slot];
+	}
+}
+
+//Completes the rate sample of an ack that delivered packets
+void rate_finish(rel_t* r, struct rate_sample *rs) {
+	rs->delivered = r->s_delivered - rs->prior_delivered;
+	// a shortage of data stops skewing samples once what was sent during it is delivered
+	if (r->s_app_limited && r->s_delivered - r->s_app_limited < 0x80000000)
+		r->s_app_limited = 0;
+}
+
+//Returns the retransmission timeout with exponential backoff applied (RFC 6298 5.5)
+long current_rto(rel_t* r) {
+	long rto = r->s_rto_us;
+	int i;
+
+	for (i = 0; i < r->s_rto_backoff && rto < r->s_rto_max_us; i++)
+		rto *= 2;
+	return rto < r->s_rto_max_us ? rto : r->s_rto_max_us;
+}
+
+//Returns when the retransmission timer started: the last send of the oldest
+//unacked packet or the last ack of new data, whichever is later (RFC 6298
+//5.3).  Within a recovery only the first partial ack restarts it (RFC 6582 4,
+//the "Impatient" variant): a loss burst wider than the SACK bitmaps is
+//repaired one hole per RTT, and the timeout cuts such a recovery short.
+const struct timespec *timer_start(rel_t* r) {
+	const struct timespec *sent = &r->s_ring_sent[r->s_last_ack_recvd & r->s_ring_mask];
+
+	if (r->s_in_recovery && r->s_rto_frozen)
+		return &r->s_rto_restart;
+	return timespec_diff_us(sent, &r->s_rto_restart) > 0 ? &r->s_rto_restart : sent;
 }
 
-// Returns how much time left (in seconds) until timeout; copied from rlib.c, need_timer_in()
-long time_until_timeout (const struct timespec *last, long timeout) {
-	long to;
-	struct timespec ts;
+//Arms the connection's timer for the retransmission deadline of the oldest
+//unacked packet, or for when pacing lets the next packet go if that is sooner;
+//disarms it when there is neither
+void arm_timer(rel_t* r) {
+	struct timespec when;
+	int in_flight = r->s_last_ack_recvd != r->s_next_tx_seq;
+
+	if (!in_flight && !r->s_pace_blocked) {
+		conn_set_timer(r->c, NULL);
+		return;
+	}
+
+	when = r->s_pace_next;
+	if (in_flight) {
+		when = *timer_start(r);
+		timespec_add_ns(&when, current_rto(r) * 1000);
+		if (r->s_pace_blocked && timespec_diff_us(&r->s_pace_next, &when) > 0)
+			when = r->s_pace_next;
+	}
+	conn_set_timer(r->c, &when);
+}
 
-	clock_gettime (CLOCK_MONOTONIC, &ts);
-	to = ts.tv_sec - last->tv_sec;
-	if (to > timeout / 1000)
+//Returns 1, noting that pacing holds a packet back, if sending at rate bytes
+//per second (0 for no pacing) leaves nothing to send until s_pace_next
+int pace_wait(rel_t* r, uint64_t rate, const struct timespec *now) {
+	if (!rate || timespec_diff_us(now, &r->s_pace_next) <= 0)
 		return 0;
-	to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-	if (to >= timeout)
+	r->s_pace_blocked = 1;
+	return 1;
+}
+
+//Spaces the packet after seqno, just sent at now, by seqno's transmission time
+//at rate.  A late wakeup keeps to the schedule by sending a burst, but never
+//more than s_pace_burst packets or PACE_SLACK_US worth, whichever is more:
+//at high rates timer wakeups are late by more than a packet.
+void pace_sent(rel_t* r, uint64_t rate, uint32_t seqno, const struct timespec *now) {
+	long gap, slack;
+
+	if (!rate)
+		return;
+	gap = r->s_ring_size[seqno & r->s_ring_mask] * 1000000000ULL / rate;
+	slack = (long) (r->s_pace_burst - 1) * gap;
+	if (slack < PACE_SLACK_US * 1000L)
+		slack = PACE_SLACK_US * 1000L;
+	if (timespec_diff_us(&r->s_pace_next, now) * 1000 > slack) {
+		r->s_pace_next = *now;
+		timespec_add_ns(&r->s_pace_next, -slack);
+	}
+	timespec_add_ns(&r->s_pace_next, gap);
+}
+
+//Returns the rate -p paces an algorithm without a pacing_rate at: cwnd per
+//smoothed RTT, with room to spare for the window to grow (Linux's
+//tcp_update_pacing_rate).  0, for no pacing, until there is an RTT sample.
+uint64_t pace_window_rate(rel_t* r) {
+	uint64_t ratio = r->s_cwnd < r->s_ssthresh / 2 ? PACE_SS_RATIO : PACE_CA_RATIO;
+
+	if (!r->s_pace || r->s_srtt_us == 0)
+		return 0;
+	return (uint64_t) r->s_cwnd * PACKET_SIZE * ratio * 10000 / r->s_srtt_us;
+}
+
+//Sets a data packet's tsval, patching its checksum for the change rather than
+//summing the whole packet again (RFC 1624 eqn. 3)
+void stamp_tsval(packet_t *pkt, uint32_t tsval) {
+	uint32_t old = ntohl(pkt->tsval);
+	uint32_t sum;
+
+	// a delay of 0 in an ack means there is none, so no packet is stamped 0
+	if (tsval == 0)
+		tsval = 1;
+	sum = (~ntohs(pkt->cksum) & 0xffff) + (~old >> 16) + (~old & 0xffff) +
+			(tsval >> 16) + (tsval & 0xffff);
+	while (sum > 0xffff)
+		sum = (sum >> 16) + (sum & 0xffff);
+	sum = ~sum & 0xffff;
+	pkt->cksum = htons(sum ? sum : 0xffff);
+	pkt->tsval = htonl(tsval);
+}
+
+//Sends the packet in slot of the retransmission ring, stamped with the time
+void send_slot(rel_t* r, uint32_t slot) {
+	clock_gettime (CLOCK_MONOTONIC, &r->s_ring_sent[slot]);
+	stamp_tsval(r->s_ring_pkt[slot], timestamp_us(&r->s_ring_sent[slot]));
+	conn_sendpkt (r->c, r->s_ring_pkt[slot], r->s_ring_size[slot]);
+	rate_on_send(r, slot, &r->s_ring_sent[slot]);
+}
+
+//Resends one packet outside the normal window accounting
+void retransmit(rel_t* r, uint32_t seqno) {
+	uint32_t slot = seqno & r->s_ring_mask;
+
+	send_slot(r, slot);
+	r->s_ring_retx[slot] = 1;
+	if (r->s_cc->on_send)
+		r->s_cc->on_send(r, seqno);
+}
+
+//Transmits packet s_next_tx_seq, first stepping over packets the receiver has
+//SACKed, which only happens when resending after a timeout; returns 0 if no
+//packet is left to send
+int transmit_next(rel_t* r) {
+	uint32_t slot;
+
+	while (r->s_next_tx_seq != r->s_next_out_pkt_seq &&
+			r->s_ring_sacked[r->s_next_tx_seq & r->s_ring_mask])
+		r->s_next_tx_seq++;
+	if (r->s_next_tx_seq == r->s_next_out_pkt_seq)
 		return 0;
-	return
-			timeout - to;
+
+	slot = r->s_next_tx_seq & r->s_ring_mask;
+	send_slot(r, slot);
+	if (r->s_next_tx_seq - r->s_last_ack_recvd < r->s_max_tx_seq - r->s_last_ack_recvd)
+		r->s_ring_retx[slot] = 1;
+	else
+		r->s_max_tx_seq = r->s_next_tx_seq + 1;
+	if (r->s_cc->on_send)
+		r->s_cc->on_send(r, r->s_next_tx_seq);
+	r->s_next_tx_seq++;
+	return 1;
 }
 
-//Adds a packet to the list of out packets waiting for acks
-void add_to_out_list(rel_t* r, packet_t *pkt, uint32_t seqno, size_t size, struct timespec* timespec) {
-	//Construct out_pkt_t
-	out_pkt_t *to_add = (out_pkt_t*) malloc(sizeof(out_pkt_t));
-	to_add->r = r;
-	to_add->pkt = pkt;
-	to_add->seqno = seqno;
-	to_add->size = size;
-	to_add->next = NULL;
-	to_add->last_try = timespec;
+//Returns the seqno below which every unSACKed packet counts as lost: the
+//DUPTHRESH'th highest SACKed packet (RFC 6675 IsLost)
+uint32_t lost_boundary(rel_t* r) {
+	uint32_t seqno = r->s_high_sacked;
+	int n = 0;
 
+	while (seqno != r->s_last_ack_recvd) {
+		seqno--;
+		if (r->s_ring_sacked[seqno & r->s_ring_mask] && ++n == DUPTHRESH)
+			return seqno;
+	}
+	return r->s_last_ack_recvd;
+}
 
-	//Add to out list
-	if (out_list_head == NULL) {
-		out_list_head = to_add;
+//Estimates the packets still in the network during recovery (RFC 6675 SetPipe):
+//neither SACKed nor lost, plus the retransmissions sent for lost ones
+uint32_t pipe_size(rel_t* r, uint32_t lost) {
+	uint32_t seqno, pipe = 0;
+
+	for (seqno = r->s_last_ack_recvd; seqno != r->s_next_tx_seq; seqno++) {
+		if (r->s_ring_sacked[seqno & r->s_ring_mask])
+			continue;
+		if (seqno - r->s_last_ack_recvd < lost - r->s_last_ack_recvd &&
+				seqno - r->s_last_ack_recvd >= r->s_high_rxt - r->s_last_ack_recvd)
+			continue;
+		pipe++;
+	}
+	return pipe;
+}
+
+//Sends during fast recovery while the pipe is below cwnd: retransmissions of
+//lost holes first, then new data (RFC 6675 NextSeg rules 1 and 2)
+void send_recovery(rel_t* r, uint64_t rate, const struct timespec *now) {
+	uint32_t lost = lost_boundary(r);
+	uint32_t pipe = pipe_size(r, lost);
+
+	while (pipe < r->s_cwnd && !pace_wait(r, rate, now)) {
+		while (r->s_high_rxt - r->s_last_ack_recvd < lost - r->s_last_ack_recvd &&
+				r->s_ring_sacked[r->s_high_rxt & r->s_ring_mask])
+			r->s_high_rxt++;
+		if (r->s_high_rxt - r->s_last_ack_recvd < lost - r->s_last_ack_recvd) {
+			retransmit(r, r->s_high_rxt++);
+			pace_sent(r, rate, r->s_high_rxt - 1, now);
+		}
+		else if (r->s_next_tx_seq - r->s_last_ack_recvd >= r->s_rwnd || !transmit_next(r)) {
+			break;
+		}
+		else {
+			pace_sent(r, rate, r->s_next_tx_seq - 1, now);
+		}
+		pipe++;
+	}
+}
+
+//Transmits queued packets for as long as the window allows; called whenever
+//a packet is queued and whenever an ack moves or widens the window.  After a
+//timeout this resends the rewound packets too, which count as retransmissions.
+//In recovery the pipe, not the span of the window, limits what is sent.  With
+//a pacing rate the packets are spaced out in time as well.
+void send_pending(rel_t* r) {
+	uint64_t rate = r->s_cc->pacing_rate ? r->s_cc->pacing_rate(r) : pace_window_rate(r);
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	r->s_pace_blocked = 0;
+	if (r->s_in_recovery)
+		send_recovery(r, rate, &now);
+	else
+		while (r->s_next_tx_seq - r->s_last_ack_recvd < min32(r->s_cwnd, r->s_rwnd) &&
+				!pace_wait(r, rate, &now)) {
+			if (!transmit_next(r)) {
+				// out of data with the window open: until what is in flight now is
+				// delivered, rate samples understate what the path can carry
+				r->s_app_limited = r->s_delivered + (r->s_next_tx_seq - r->s_last_ack_recvd);
+				if (r->s_app_limited == 0)
+					r->s_app_limited = 1;
+				break;
+			}
+			pace_sent(r, rate, r->s_next_tx_seq - 1, &now);
+		}
+	arm_timer(r);
+}
+
+//Feeds an RTT sample into SRTT/RTTVAR and recomputes the RTO (RFC 6298 2.2-2.4)
+void update_rto(rel_t* r, long rtt_us) {
+	long err;
+
+	if (r->s_srtt_us == 0) {
+		r->s_srtt_us = rtt_us;
+		r->s_rttvar_us = rtt_us / 2;
 	}
 	else {
-		out_pkt_t* temp = out_list_head;
-		while (temp->next != NULL)
-			temp = temp->next;
-		temp->next = to_add;
+		err = rtt_us - r->s_srtt_us;
+		if (err < 0)
+			err = -err;
+		r->s_rttvar_us += (err - r->s_rttvar_us) / 4;    // beta = 1/4
+		r->s_srtt_us += (rtt_us - r->s_srtt_us) / 8;     // alpha = 1/8
 	}
+
+	// the minimum bounds the variance term rather than the whole RTO, as in
+	// Linux, so a steady RTT still leaves headroom for queueing jitter
+	r->s_rto_us = r->s_srtt_us + (4 * r->s_rttvar_us > r->s_rto_min_us ?
+			4 * r->s_rttvar_us : r->s_rto_min_us);
+	if (r->s_rto_us > r->s_rto_max_us)
+		r->s_rto_us = r->s_rto_max_us;
+	// a valid sample ends any backoff (RFC 6298 5.7)
+	r->s_rto_backoff = 0;
+
+	if (opt_debug)
+		fprintf(stderr, "rtt %ld us: srtt %ld us, rttvar %ld us, rto %ld us\n",
+				rtt_us, r->s_srtt_us, r->s_rttvar_us, r->s_rto_us);
+}
+
+//Takes an RTT sample from a new cumulative ack, timed against the newest packet
+//it covers, and returns it, or -1 if there is none.  Karn's rule withholds the
+//sample if that packet was retransmitted.  It is also withheld if some packet in
+//the acked range was retransmitted after the newest one was sent: the ack may
+//then be for the filled hole, with the newest packet sitting in the peer's
+//reassembly buffer meanwhile.  Otherwise, as the path does not reorder, the
+//newest packet arrived last and its arrival is what produced this ack.
+long sample_rtt(rel_t* r, uint32_t ackno, const struct timespec *now) {
+	uint32_t seqno, slot, newest = (ackno - 1) & r->s_ring_mask;
+
+	if (r->s_ring_retx[newest])
+		return -1;
+	for (seqno = r->s_last_ack_recvd; seqno != ackno - 1; seqno++) {
+		slot = seqno & r->s_ring_mask;
+		if (r->s_ring_retx[slot] &&
+				timespec_diff_us(&r->s_ring_sent[newest], &r->s_ring_sent[slot]) > 0)
+			return -1;
+	}
+	return timespec_diff_us(&r->s_ring_sent[newest], now);
+}
+
+//Records the packets an ack SACKs in the scoreboard, returning how many of
+//them it SACKs for the first time; those count as delivered at now
+int update_scoreboard(rel_t* r, const struct ack_packet *ack,
+		struct rate_sample *rs, const struct timespec *now) {
+	uint32_t seqno;
+	int i, newly = 0;
+
+	for (i = 0; i < SACK_BITS; i++) {
+		if (!((ack->sack[i / 8] >> (i % 8)) & 1))
+			continue;
+		seqno = ntohl(ack->ackno) + 1 + i;
+		if (seqno - r->s_last_ack_recvd >= r->s_max_tx_seq - r->s_last_ack_recvd)
+			break;
+		if (!r->s_ring_sacked[seqno & r->s_ring_mask]) {
+			rate_on_delivered(r, rs, seqno, now);
+			newly++;
+		}
+		r->s_ring_sacked[seqno & r->s_ring_mask] = 1;
+		if (seqno - r->s_last_ack_recvd >= r->s_high_sacked - r->s_last_ack_recvd)
+			r->s_high_sacked = seqno + 1;
+	}
+	return newly;
+}
+
+//Counts the packets below ackno that were not SACKed already as delivered at now
+void deliver_acked(rel_t* r, uint32_t ackno, struct rate_sample *rs,
+		const struct timespec *now) {
+	uint32_t seqno;
+
+	for (seqno = r->s_last_ack_recvd; seqno != ackno; seqno++)
+		if (!r->s_ring_sacked[seqno & r->s_ring_mask])
+			rate_on_delivered(r, rs, seqno, now);
+}
+
+//Frees every packet below ackno, which the other side has now acknowledged
+void release_acked(rel_t* r, uint32_t ackno) {
+	// after a timeout rewound s_next_tx_seq, the ack may cover packets not yet resent
+	if (r->s_next_tx_seq - r->s_last_ack_recvd < ackno - r->s_last_ack_recvd)
+		r->s_next_tx_seq = ackno;
+	// the scoreboard cursors never fall behind the cumulative ack
+	if (r->s_high_sacked - r->s_last_ack_recvd < ackno - r->s_last_ack_recvd)
+		r->s_high_sacked = ackno;
+	if (r->s_high_rxt - r->s_last_ack_recvd < ackno - r->s_last_ack_recvd)
+		r->s_high_rxt = ackno;
+	for (; r->s_last_ack_recvd != ackno; r->s_last_ack_recvd++)
+		conn_pktfree(r->c, r->s_ring_pkt[r->s_last_ack_recvd & r->s_ring_mask]);
 }
 
 void send_eof(rel_t* s) {
 	if (s->send_eof == 0) {
 		//Make EOF
-		packet_t *to_send = (packet_t*) malloc(sizeof(packet_t));
+		packet_t *to_send = conn_pktalloc(s->c);
 		to_send->cksum = 0x0000;
 		to_send->ackno = htonl(s->r_next_exp_seq);
 		to_send->seqno = htonl(s->s_next_out_pkt_seq);
+		to_send->tsval = 0;
 		to_send->len = htons(HEADER_SIZE);
-		to_send->rwnd = htonl((conn_bufspace(s->c))/MSS);
+		to_send->rwnd = htonl(recv_window(s));
 		to_send->cksum = cksum ((void*) to_send, HEADER_SIZE);
 
-		//Send and add to list
+		//Add to ring and send
 		s->send_eof = 1;
-		conn_sendpkt (s->c, to_send, HEADER_SIZE);
-		struct timespec *timespec = (struct timespec*) malloc(sizeof(struct timespec));
-		clock_gettime (CLOCK_MONOTONIC, timespec);
-		add_to_out_list(s, to_send, s->s_next_out_pkt_seq, HEADER_SIZE, timespec);
+		add_to_send_ring(s, to_send, HEADER_SIZE);
 
 		//Increment sequence number
 		s->s_next_out_pkt_seq++;
+		send_pending(s);
+	}
+}
+
+//Allocates the reassembly ring with size slots (a power of two, >= 64)
+void init_recv_ring(rel_t* r, uint32_t size) {
+	r->r_ring_mask = size - 1;
+	r->r_ring_pkt = (packet_t**) xmalloc(size * sizeof(packet_t*));
+	r->r_ring_len = (uint16_t*) xmalloc(size * sizeof(uint16_t));
+	r->r_present = (uint64_t*) xmalloc(size / 64 * sizeof(uint64_t));
+	memset(r->r_present, 0, size / 64 * sizeof(uint64_t));
+}
+
+int is_present(rel_t* r, uint32_t seqno) {
+	uint32_t bit = seqno & r->r_ring_mask;
+	return (r->r_present[bit / 64] >> (bit % 64)) & 1;
+}
+
+//Keeps a received data packet, size bytes of it, in its slot of the
+//reassembly ring; returns 0, leaving pkt with the caller, if the slot is taken
+int add_to_recv_ring(rel_t* r, packet_t *pkt, size_t size) {
+	uint32_t seqno = ntohl(pkt->seqno);
+	uint32_t bit = seqno & r->r_ring_mask;
+
+	if (is_present(r, seqno))
+		return 0;
+
+	r->r_ring_pkt[bit] = pkt;
+	r->r_ring_len[bit] = size - HEADER_SIZE;
+	r->r_present[bit / 64] |= (uint64_t) 1 << (bit % 64);
+	return 1;
+}
+
+//Frees the packet in seqno's slot of the reassembly ring
+void remove_from_recv_ring(rel_t* r, uint32_t seqno) {
+	uint32_t bit = seqno & r->r_ring_mask;
+
+	conn_pktfree(r->c, r->r_ring_pkt[bit]);
+	r->r_present[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+}
+
+//Returns how many consecutive packets starting at seqno are in the reassembly
+//ring, looking at no more than limit slots (find-first-zero over r_present)
+uint32_t count_present(rel_t* r, uint32_t seqno, uint32_t limit) {
+	uint32_t count = 0;
+	uint32_t bit;
+	uint64_t missing;
+
+	while (count < limit) {
+		bit = (seqno + count) & r->r_ring_mask;
+		missing = ~r->r_present[bit / 64] >> (bit % 64);
+		if (missing) {
+			count += __builtin_ctzll(missing);
+			break;
+		}
+		count += 64 - bit % 64;
 	}
+	return count < limit ? count : limit;
 }
 
-//Adds a packet to the list of in packets
-void add_to_in_list(rel_t* r, packet_t *pkt, size_t size) {
-	//Construct in_pkt_t
-	in_pkt_t *to_add = (in_pkt_t*) malloc(sizeof(in_pkt_t));
-	to_add->r = r;
-	to_add->pkt = pkt;
-	to_add->seqno = ntohl(pkt->seqno);
-	to_add->progress = 0;
-	to_add->len = ntohs(pkt->len) - HEADER_SIZE;
-	to_add->size = size;
-	to_add->next = NULL;
+//Grows the receive buffer when the sender is delivering close to a full buffer
+//per RTT.  The receiver times an RTT as the time from advertising a window to
+//receiving the packet at its right edge (cf. Linux's tcp_rcv_rtt_measure), and
+//each RTT sets r_rcvbuf to twice what was delivered to the output in it.
+void tune_rcvbuf(rel_t* r) {
+	struct timespec now;
+	uint32_t copied;
+	long sample;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
 
-	//Add to in list
-	if (in_list_head == NULL) {
-		in_list_head = to_add;
+	if (r->r_rtt_seq == 0) {
+		r->r_rtt_seq = r->r_next_exp_seq + recv_window(r);
+		r->r_rtt_time = now;
+	}
+	else if (r->r_next_exp_seq >= r->r_rtt_seq) {
+		sample = timespec_diff_us(&r->r_rtt_time, &now);
+		if (r->r_rtt_us == 0 || sample < r->r_rtt_us)
+			r->r_rtt_us = sample;
+		else
+			r->r_rtt_us = (7 * r->r_rtt_us + sample) / 8;
+		r->r_rtt_seq = 0;
+	}
+
+	if (r->r_rtt_us == 0 || timespec_diff_us(&r->r_space_time, &now) < r->r_rtt_us)
+		return;
+
+	copied = r->r_to_print_pkt_seq - r->r_space_seq;
+	if (2 * copied > r->r_rcvbuf && r->r_rcvbuf < r->r_rcvbuf_max) {
+		r->r_rcvbuf = min32(2 * copied, r->r_rcvbuf_max);
+		if (opt_debug)
+			fprintf(stderr, "rcvbuf: %u packets (rtt %ld us, %u delivered)\n",
+					r->r_rcvbuf, r->r_rtt_us, copied);
+	}
+	r->r_space_seq = r->r_to_print_pkt_seq;
+	r->r_space_time = now;
+}
+
+//Half the packets in flight, but at least 2 (RFC 5681 eq. 4)
+uint32_t loss_ssthresh(rel_t* r) {
+	uint32_t flight = r->s_next_tx_seq - r->s_last_ack_recvd;
+
+	return flight / 2 > 2 ? flight / 2 : 2;
+}
+
+//Returns whether the sender is filling the window, so that it may grow.  As in
+//Linux's tcp_is_cwnd_limited, half the window counts as full in slow start.
+//Being held back by rwnd or input must not build up a window that would later
+//be released as one burst.
+int cwnd_limited(rel_t* r, uint32_t flight) {
+	if (r->s_cwnd < r->s_ssthresh)
+		return 2 * flight >= r->s_cwnd;
+	return flight >= r->s_cwnd;
+}
+
+//Slow start (RFC 5681 3.1): grows cwnd by the packets acked, up to ssthresh,
+//and returns how many of them are left over for congestion avoidance
+uint32_t slow_start(rel_t* r, uint32_t acked) {
+	if (r->s_cwnd >= r->s_ssthresh)
+		return acked;
+	r->s_cwnd += acked;
+	if (r->s_cwnd <= r->s_ssthresh)
+		return 0;
+	acked = r->s_cwnd - r->s_ssthresh;
+	r->s_cwnd = r->s_ssthresh;
+	return acked;
+}
+
+// NewReno window management (RFC 5681): slow start, then one packet per window
+struct reno {
+	uint32_t cwnd_cnt;                // packets acked towards the next congestion avoidance increase
+};
+
+void reno_init(rel_t* r) {
+	struct reno *ca = (struct reno*) r->s_cc_priv;
+
+	ca->cwnd_cnt = 0;
+}
+
+void reno_on_ack(rel_t* r, const struct rate_sample *rs) {
+	struct reno *ca = (struct reno*) r->s_cc_priv;
+	uint32_t acked;
+
+	if (r->s_in_recovery || !cwnd_limited(r, rs->prior_flight))
+		return;
+
+	acked = slow_start(r, rs->acked);
+	ca->cwnd_cnt += acked;
+	while (ca->cwnd_cnt >= r->s_cwnd) {
+		ca->cwnd_cnt -= r->s_cwnd;
+		r->s_cwnd++;
+	}
+}
+
+void reno_on_loss(rel_t* r, enum cc_loss kind) {
+	struct reno *ca = (struct reno*) r->s_cc_priv;
+
+	ca->cwnd_cnt = 0;
+	if (kind == CC_LOSS_DUPACK) {
+		r->s_ssthresh = loss_ssthresh(r);
+		r->s_cwnd = r->s_ssthresh;
+		return;
+	}
+
+	// a second timeout for the same packet keeps the ssthresh of the first
+	if (r->s_rto_backoff == 0)
+		r->s_ssthresh = loss_ssthresh(r);
+	r->s_cwnd = 1;
+}
+
+const struct cc_ops cc_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.on_ack = reno_on_ack,
+	.on_loss = reno_on_loss,
+};
+
+// CUBIC (RFC 8312): after a reduction the window grows along a cubic curve
+// that flattens out around W_max, the window at which the loss happened, and
+// then probes beyond it, so growth depends on time since the loss rather than
+// on how many RTTs have passed.  Units are packets and seconds.
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+struct cubic {
+	double w_max;                     // window before the last reduction
+	double w_last_max;                // the W_max before that, for fast convergence
+	double k;                         // seconds the curve takes to climb back to w_max
+	double origin;                    // window the curve is centred on
+	double w_est;                     // window Reno would have by now (RFC 8312 4.2)
+	uint32_t ack_cnt;                 // packets acked towards the next increase
+	int in_epoch;                     // 1 once epoch_start is set
+	struct timespec epoch_start;      // when congestion avoidance began after the last loss
+};
+
+void cubic_init(rel_t* r) {
+	struct cubic *ca = (struct cubic*) r->s_cc_priv;
+
+	memset(ca, 0, sizeof(*ca));
+}
+
+void cubic_on_ack(rel_t* r, const struct rate_sample *rs) {
+	struct cubic *ca = (struct cubic*) r->s_cc_priv;
+	struct timespec now;
+	double t, target;
+	uint32_t acked, cnt;
+
+	if (r->s_in_recovery || !cwnd_limited(r, rs->prior_flight))
+		return;
+
+	acked = slow_start(r, rs->acked);
+	if (acked == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!ca->in_epoch) {
+		ca->in_epoch = 1;
+		ca->epoch_start = now;
+		ca->ack_cnt = 0;
+		ca->w_est = r->s_cwnd;
+		if (ca->w_max > r->s_cwnd) {
+			ca->k = cbrt((ca->w_max - r->s_cwnd) / CUBIC_C);
+			ca->origin = ca->w_max;
+		}
+		else {
+			ca->k = 0;
+			ca->origin = r->s_cwnd;
+		}
+	}
+
+	// aim for where the curve will be one RTT from now (RFC 8312 4.1, 4.3)
+	t = (timespec_diff_us(&ca->epoch_start, &now) + r->s_srtt_us) / 1e6 - ca->k;
+	target = ca->origin + CUBIC_C * t * t * t;
+
+	// never grow slower than Reno would (RFC 8312 4.2)
+	ca->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * acked / r->s_cwnd;
+	if (ca->w_est > target)
+		target = ca->w_est;
+
+	// one packet for every cnt acked gets there in an RTT; at most 1.5x per
+	// RTT, as in Linux
+	if (target > r->s_cwnd + r->s_cwnd / 2.0)
+		cnt = 2;
+	else if (target > r->s_cwnd)
+		cnt = r->s_cwnd / (target - r->s_cwnd);
+	else
+		cnt = 100 * r->s_cwnd;
+	if (cnt < 2)
+		cnt = 2;
+
+	ca->ack_cnt += acked;
+	if (ca->ack_cnt >= cnt) {
+		r->s_cwnd += ca->ack_cnt / cnt;
+		ca->ack_cnt %= cnt;
+	}
+}
+
+void cubic_on_loss(rel_t* r, enum cc_loss kind) {
+	struct cubic *ca = (struct cubic*) r->s_cc_priv;
+	double ssthresh;
+
+	ca->in_epoch = 0;
+
+	// a second timeout for the same packet keeps the state of the first
+	if (kind == CC_LOSS_TIMEOUT && r->s_rto_backoff > 0) {
+		r->s_cwnd = 1;
+		return;
+	}
+
+	// fast convergence (RFC 8312 4.6): a flow whose W_max keeps shrinking is
+	// losing out to new flows, so it gives up more
+	if (r->s_cwnd < ca->w_last_max) {
+		ca->w_last_max = r->s_cwnd;
+		ca->w_max = r->s_cwnd * (1 + CUBIC_BETA) / 2;
 	}
 	else {
-		in_pkt_t* temp = in_list_head;
-		while (temp != NULL) {
-			if (temp->seqno == to_add->seqno) {
-				return;
-			}
-			if (temp->next == NULL) {
-				temp->next = to_add;
-				break;
-			}
-			temp = temp->next;
+		ca->w_last_max = r->s_cwnd;
+		ca->w_max = r->s_cwnd;
+	}
+
+	ssthresh = r->s_cwnd * CUBIC_BETA;
+	r->s_ssthresh = ssthresh > 2 ? ssthresh : 2;
+	r->s_cwnd = kind == CC_LOSS_TIMEOUT ? 1 : r->s_ssthresh;
+}
+
+const struct cc_ops cc_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.on_ack = cubic_on_ack,
+	.on_loss = cubic_on_loss,
+};
+
+// BBR (draft-cardwell-iccrg-bbr-congestion-control, version 1): rather than
+// backing off on loss, it models the path by its bottleneck bandwidth, the
+// windowed max of delivery-rate samples, and its propagation delay, the
+// windowed min RTT.  It paces at about that bandwidth and keeps about twice
+// their product in flight, so the bottleneck queue stays short.  It cycles
+// through four modes: STARTUP doubles the rate each round until bandwidth
+// stops growing, DRAIN empties the queue that built, PROBE_BW spends one
+// round in eight sending faster and one sending slower, and PROBE_RTT drops
+// to a few packets now and then to measure the RTT on an empty queue.
+// Bandwidth is in packets per second.
+#define BBR_BW_ROUNDS 10               // rounds the bandwidth filter spans
+#define BBR_MIN_RTT_US 10000000L       // how long a min RTT sample stays good
+#define BBR_PROBE_RTT_US 200000L       // least time PROBE_RTT holds cwnd down
+#define BBR_MIN_CWND 4
+#define BBR_INIT_CWND 25               // target before the first RTT sample, the initial cwnd
+#define BBR_HIGH_GAIN 2.885            // 2/ln(2): doubles the delivery rate each round
+#define BBR_CYCLE_LEN 8
+
+enum bbr_mode { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+const double bbr_cycle_gain[BBR_CYCLE_LEN] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+
+struct bbr {
+	enum bbr_mode mode;
+	double pacing_gain;
+	double cwnd_gain;
+	uint32_t round;                   // packet-timed round trips so far
+	uint32_t next_round_delivered;    // s_delivered that ends the current round
+	int round_start;                  // 1 if this ack began a round
+	double bw[BBR_BW_ROUNDS];         // highest delivery rate of each recent round
+	uint32_t bw_rounds;               // rounds that age the bandwidth filter
+	uint32_t bw_round;                // bw_rounds at the newest entry
+	long min_rtt_us;                  // -1 until the first sample
+	struct timespec min_rtt_stamp;    // when min_rtt_us was taken
+	int cycle_idx;                    // phase of the PROBE_BW gain cycle
+	struct timespec cycle_stamp;      // when that phase began
+	double full_bw;                   // bandwidth when STARTUP last grew by a quarter
+	int full_bw_cnt;                  // rounds since then
+	int filled_pipe;                  // 1 once STARTUP has found the bandwidth
+	int probe_rtt_armed;              // PROBE_RTT has got cwnd down to BBR_MIN_CWND
+	int probe_rtt_round_done;         // ...and a round has passed since
+	struct timespec probe_rtt_done;   // ...and it may end at this time
+	uint32_t prior_cwnd;              // cwnd to return to after loss recovery or PROBE_RTT
+	int restore_cwnd;                 // 1 while prior_cwnd is waiting to be restored
+};
+
+void bbr_init(rel_t* r) {
+	struct bbr *ca = (struct bbr*) r->s_cc_priv;
+
+	assert(sizeof(*ca) <= sizeof(r->s_cc_priv));
+	memset(ca, 0, sizeof(*ca));
+	ca->mode = BBR_STARTUP;
+	ca->pacing_gain = BBR_HIGH_GAIN;
+	ca->cwnd_gain = BBR_HIGH_GAIN;
+	ca->min_rtt_us = -1;
+	clock_gettime(CLOCK_MONOTONIC, &ca->min_rtt_stamp);
+}
+
+double bbr_max_bw(struct bbr *ca) {
+	double bw = 0;
+	int i;
+
+	for (i = 0; i < BBR_BW_ROUNDS; i++)
+		if (ca->bw[i] > bw)
+			bw = ca->bw[i];
+	return bw;
+}
+
+//Returns whether the sender is repairing loss: in fast recovery, or resending
+//what was outstanding at the last timeout
+int bbr_repairing(rel_t* r) {
+	return r->s_in_recovery || r->s_last_ack_recvd - r->s_recover >= 0x80000000;
+}
+
+//Enters bw into the windowed max filter for the current round, first dropping
+//the rounds that fall out of the window
+void bbr_update_bw(struct bbr *ca, double bw) {
+	int i;
+
+	for (i = 0; ca->bw_round != ca->bw_rounds && i < BBR_BW_ROUNDS; i++)
+		ca->bw[++ca->bw_round % BBR_BW_ROUNDS] = 0;
+	ca->bw_round = ca->bw_rounds;
+	if (bw > ca->bw[ca->bw_round % BBR_BW_ROUNDS])
+		ca->bw[ca->bw_round % BBR_BW_ROUNDS] = bw;
+}
+
+//Returns gain times the estimated bandwidth-delay product, in packets
+double bbr_bdp(struct bbr *ca, double gain) {
+	if (ca->min_rtt_us < 0 || bbr_max_bw(ca) == 0)
+		return BBR_INIT_CWND;
+	return gain * bbr_max_bw(ca) * ca->min_rtt_us / 1e6;
+}
+
+void bbr_enter_probe_bw(struct bbr *ca, const struct timespec *now) {
+	ca->mode = BBR_PROBE_BW;
+	ca->cwnd_gain = 2;
+	// start anywhere in the cycle but at the phase that drains the queue
+	ca->cycle_idx = (2 + random() % (BBR_CYCLE_LEN - 1)) % BBR_CYCLE_LEN;
+	ca->pacing_gain = bbr_cycle_gain[ca->cycle_idx];
+	ca->cycle_stamp = *now;
+}
+
+//Moves through the PROBE_BW cycle, a phase per min RTT.  Probing faster goes on
+//until there is loss or the extra data is in flight; the phase after it, which
+//drains what that probe queued, ends early once the queue is gone.
+void bbr_update_cycle(rel_t* r, struct bbr *ca, const struct rate_sample *rs,
+		const struct timespec *now) {
+	int next;
+
+	if (ca->mode != BBR_PROBE_BW)
+		return;
+
+	next = timespec_diff_us(&ca->cycle_stamp, now) > ca->min_rtt_us;
+	if (ca->pacing_gain > 1)
+		next = next && (r->s_in_recovery || rs->prior_flight >= bbr_bdp(ca, ca->pacing_gain));
+	else if (ca->pacing_gain < 1)
+		next = next || rs->prior_flight <= bbr_bdp(ca, 1);
+	if (next) {
+		ca->cycle_idx = (ca->cycle_idx + 1) % BBR_CYCLE_LEN;
+		ca->pacing_gain = bbr_cycle_gain[ca->cycle_idx];
+		ca->cycle_stamp = *now;
+	}
+}
+
+//Decides when STARTUP has filled the pipe: three rounds in a row that did not
+//raise the bandwidth by a quarter
+void bbr_check_full_pipe(struct bbr *ca, const struct rate_sample *rs) {
+	if (ca->filled_pipe || !ca->round_start || rs->app_limited)
+		return;
+	if (bbr_max_bw(ca) >= ca->full_bw * 1.25) {
+		ca->full_bw = bbr_max_bw(ca);
+		ca->full_bw_cnt = 0;
+		return;
+	}
+	if (++ca->full_bw_cnt >= 3)
+		ca->filled_pipe = 1;
+}
+
+void bbr_check_drain(rel_t* r, struct bbr *ca, const struct timespec *now) {
+	if (ca->mode == BBR_STARTUP && ca->filled_pipe) {
+		ca->mode = BBR_DRAIN;
+		ca->pacing_gain = 1 / BBR_HIGH_GAIN;
+	}
+	if (ca->mode == BBR_DRAIN &&
+			r->s_next_tx_seq - r->s_last_ack_recvd <= bbr_bdp(ca, 1))
+		bbr_enter_probe_bw(ca, now);
+}
+
+//Keeps the min RTT and, when it has gone BBR_MIN_RTT_US without a new one,
+//spends a round and BBR_PROBE_RTT_US with cwnd at BBR_MIN_CWND to drain the
+//queue and measure it afresh
+void bbr_update_min_rtt(rel_t* r, struct bbr *ca, const struct rate_sample *rs,
+		const struct timespec *now) {
+	uint32_t flight = r->s_next_tx_seq - r->s_last_ack_recvd;
+	int expired = timespec_diff_us(&ca->min_rtt_stamp, now) > BBR_MIN_RTT_US;
+
+	if (rs->rtt_us >= 0 &&
+			(ca->min_rtt_us < 0 || rs->rtt_us <= ca->min_rtt_us || expired)) {
+		ca->min_rtt_us = rs->rtt_us;
+		ca->min_rtt_stamp = *now;
+	}
+
+	if (expired && ca->mode != BBR_PROBE_RTT) {
+		ca->mode = BBR_PROBE_RTT;
+		ca->pacing_gain = 1;
+		ca->cwnd_gain = 1;
+		ca->probe_rtt_armed = 0;
+		if (!ca->restore_cwnd)
+			ca->prior_cwnd = r->s_cwnd;
+		ca->restore_cwnd = 1;
+	}
+	if (ca->mode != BBR_PROBE_RTT)
+		return;
+
+	if (!ca->probe_rtt_armed) {
+		if (flight > BBR_MIN_CWND)
+			return;
+		ca->probe_rtt_armed = 1;
+		ca->probe_rtt_round_done = 0;
+		ca->probe_rtt_done = *now;
+		timespec_add_ns(&ca->probe_rtt_done, BBR_PROBE_RTT_US * 1000);
+		ca->next_round_delivered = r->s_delivered;
+		return;
+	}
+	if (ca->round_start)
+		ca->probe_rtt_round_done = 1;
+	if (ca->probe_rtt_round_done && timespec_diff_us(&ca->probe_rtt_done, now) >= 0) {
+		ca->min_rtt_stamp = *now;
+		if (ca->filled_pipe) {
+			bbr_enter_probe_bw(ca, now);
+		}
+		else {
+			ca->mode = BBR_STARTUP;
+			ca->pacing_gain = BBR_HIGH_GAIN;
+			ca->cwnd_gain = BBR_HIGH_GAIN;
 		}
 	}
 }
 
-//Finds an in_pkt based on seqno
-in_pkt_t* get_in_pkt(uint32_t seqno) {
-	in_pkt_t* temp = in_list_head;
-	while (temp != NULL) {
-		if (temp->seqno == seqno)
-			break;
-		temp = temp->next;
+//Grows cwnd by what the ack delivered towards cwnd_gain times the BDP, plus a
+//few packets for delayed and stretched acks.  The cwnd cut on loss or for
+//PROBE_RTT comes back once that is over.
+void bbr_set_cwnd(rel_t* r, struct bbr *ca, const struct rate_sample *rs) {
+	uint32_t target = bbr_bdp(ca, ca->cwnd_gain) + 3;
+
+	if (ca->restore_cwnd && ca->mode != BBR_PROBE_RTT && !r->s_in_recovery &&
+			r->s_last_ack_recvd - r->s_recover < 0x80000000) {
+		if (r->s_cwnd < ca->prior_cwnd)
+			r->s_cwnd = ca->prior_cwnd;
+		ca->restore_cwnd = 0;
+	}
+
+	if (ca->filled_pipe)
+		r->s_cwnd = r->s_cwnd + rs->newly_delivered < target ?
+				r->s_cwnd + rs->newly_delivered : target;
+	else if (r->s_cwnd < target)
+		r->s_cwnd += rs->newly_delivered;
+	if (r->s_cwnd < BBR_MIN_CWND)
+		r->s_cwnd = BBR_MIN_CWND;
+	if (ca->mode == BBR_PROBE_RTT && r->s_cwnd > BBR_MIN_CWND)
+		r->s_cwnd = BBR_MIN_CWND;
+}
+
+void bbr_on_ack(rel_t* r, const struct rate_sample *rs) {
+	struct bbr *ca = (struct bbr*) r->s_cc_priv;
+	struct timespec now;
+	double bw;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// a round trip ends when a packet sent after it began is delivered
+	ca->round_start = 0;
+	if (rs->newly_delivered && rs->prior_delivered - ca->next_round_delivered < 0x80000000) {
+		ca->next_round_delivered = r->s_delivered;
+		ca->round++;
+		ca->round_start = 1;
+		// a round spent repairing loss says little about the bandwidth, and
+		// after a timeout such rounds would age out the estimate before cwnd
+		// has grown back to use it
+		if (!bbr_repairing(r))
+			ca->bw_rounds++;
+	}
+
+	// samples shorter than the min RTT come from acks bunched up on the way
+	// back; app-limited ones only count when they show more bandwidth
+	if (rs->interval_us > 0 && rs->interval_us >= ca->min_rtt_us) {
+		bw = rs->delivered * 1e6 / rs->interval_us;
+		if (!rs->app_limited || bw >= bbr_max_bw(ca))
+			bbr_update_bw(ca, bw);
+	}
+
+	bbr_update_cycle(r, ca, rs, &now);
+	bbr_check_full_pipe(ca, rs);
+	bbr_check_drain(r, ca, &now);
+	bbr_update_min_rtt(r, ca, rs, &now);
+	bbr_set_cwnd(r, ca, rs);
+}
+
+//Loss says little about the path to BBR.  Recovery restarts from what is
+//still in the network, and a timeout from one packet, each growing back by
+//what gets delivered; cwnd returns to where it was once recovery is over.
+//ssthresh is kept out of the way of the deflation at the end of recovery.
+void bbr_on_loss(rel_t* r, enum cc_loss kind) {
+	struct bbr *ca = (struct bbr*) r->s_cc_priv;
+	uint32_t pipe;
+
+	if (!ca->restore_cwnd)
+		ca->prior_cwnd = r->s_cwnd;
+	ca->restore_cwnd = 1;
+	r->s_ssthresh = UINT32_MAX;
+	// startup overflowed the queue, so the pipe is full (as in BBR v2)
+	if (ca->mode == BBR_STARTUP)
+		ca->filled_pipe = 1;
+	if (kind == CC_LOSS_TIMEOUT) {
+		r->s_cwnd = 1;
+		return;
+	}
+	pipe = pipe_size(r, lost_boundary(r));
+	r->s_cwnd = pipe + 1 > BBR_MIN_CWND ? pipe + 1 : BBR_MIN_CWND;
+}
+
+//Paces at pacing_gain times the bandwidth, or before there is any estimate,
+//at the initial cwnd per RTT (1 ms before there is an RTT sample, as in Linux)
+uint64_t bbr_pacing_rate(rel_t* r) {
+	struct bbr *ca = (struct bbr*) r->s_cc_priv;
+	double bw = bbr_max_bw(ca);
+
+	if (bw == 0)
+		bw = BBR_INIT_CWND * 1e6 / (r->s_srtt_us ? r->s_srtt_us : 1000);
+	return ca->pacing_gain * bw * PACKET_SIZE;
+}
+
+const struct cc_ops cc_bbr = {
+	.name = "bbr",
+	.init = bbr_init,
+	.on_ack = bbr_on_ack,
+	.on_loss = bbr_on_loss,
+	.pacing_rate = bbr_pacing_rate,
+};
+
+// LEDBAT (RFC 6817), a scavenger for background transfers.  It estimates the
+// queueing delay it causes as the one-way delay the acks report less the
+// least seen over the last minutes (the base delay), and steers cwnd towards
+// adding LEDBAT_TARGET_US of it: up by at most a packet per RTT below the
+// target, down in proportion above it.  So it yields to loss-based flows
+// sharing the bottleneck long before they see loss.  Slow start ends when the
+// queueing delay reaches 3/4 of the target, as in LEDBAT++.  Delays are
+// compared modulo 2^32, the receiver's clock having an unknown offset.
+#define LEDBAT_TARGET_US 25000
+#define LEDBAT_GAIN 1.0
+#define LEDBAT_BASE_HISTORY 10         // minutes the base delay is the least over
+#define LEDBAT_CURRENT_FILTER 4        // recent delays the current delay is the least of
+#define LEDBAT_ALLOWED_INCREASE 1      // packets cwnd may exceed the flight size by
+#define LEDBAT_MIN_CWND 2
+
+struct ledbat {
+	uint32_t base[LEDBAT_BASE_HISTORY];       // least delay of each recent minute
+	int base_idx;                             // entry for the current minute
+	time_t base_minute;                       // which minute that is
+	uint32_t current[LEDBAT_CURRENT_FILTER];  // the latest delays
+	int current_idx;                          // entry for the latest
+	int have_delay;                           // 1 once the filters hold a delay
+	double cwnd;                              // cwnd, with the fraction the increase needs
+};
+
+void ledbat_init(rel_t* r) {
+	struct ledbat *ca = (struct ledbat*) r->s_cc_priv;
+
+	memset(ca, 0, sizeof(*ca));
+	ca->cwnd = r->s_cwnd;
+}
+
+//Feeds a one-way delay into the base and current delay filters
+void ledbat_update_delay(struct ledbat *ca, uint32_t delay, const struct timespec *now) {
+	time_t minute = now->tv_sec / 60;
+	int i;
+
+	if (!ca->have_delay) {
+		for (i = 0; i < LEDBAT_BASE_HISTORY; i++)
+			ca->base[i] = delay;
+		for (i = 0; i < LEDBAT_CURRENT_FILTER; i++)
+			ca->current[i] = delay;
+		ca->base_minute = minute;
+		ca->have_delay = 1;
+		return;
+	}
+
+	if (minute != ca->base_minute) {
+		ca->base_minute = minute;
+		ca->base_idx = (ca->base_idx + 1) % LEDBAT_BASE_HISTORY;
+		ca->base[ca->base_idx] = delay;
+	}
+	else if ((int32_t) (delay - ca->base[ca->base_idx]) < 0) {
+		ca->base[ca->base_idx] = delay;
+	}
+	ca->current_idx = (ca->current_idx + 1) % LEDBAT_CURRENT_FILTER;
+	ca->current[ca->current_idx] = delay;
+}
+
+//Returns the queueing delay: the current delay less the base delay
+long ledbat_queueing_delay(struct ledbat *ca) {
+	uint32_t base = ca->base[0], current = ca->current[0];
+	int i;
+
+	for (i = 1; i < LEDBAT_BASE_HISTORY; i++)
+		if ((int32_t) (ca->base[i] - base) < 0)
+			base = ca->base[i];
+	for (i = 1; i < LEDBAT_CURRENT_FILTER; i++)
+		if ((int32_t) (ca->current[i] - current) < 0)
+			current = ca->current[i];
+	return (int32_t) (current - base);
+}
+
+void ledbat_on_ack(rel_t* r, const struct rate_sample *rs) {
+	struct ledbat *ca = (struct ledbat*) r->s_cc_priv;
+	struct timespec now;
+	long queueing_us;
+	uint32_t acked, max_allowed;
+	double change;
+
+	if (!rs->owd_us)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ledbat_update_delay(ca, rs->owd_us, &now);
+	if (r->s_in_recovery || rs->newly_delivered == 0)
+		return;
+
+	// the transport deflates cwnd when recovery ends
+	if ((uint32_t) ca->cwnd != r->s_cwnd)
+		ca->cwnd = r->s_cwnd;
+
+	queueing_us = ledbat_queueing_delay(ca);
+	acked = rs->newly_delivered;
+	if (r->s_cwnd < r->s_ssthresh) {
+		if (queueing_us >= LEDBAT_TARGET_US * 3 / 4) {
+			r->s_ssthresh = r->s_cwnd;
+		}
+		else if (cwnd_limited(r, rs->prior_flight)) {
+			acked = slow_start(r, acked);
+			ca->cwnd = r->s_cwnd;
+		}
+	}
+
+	change = LEDBAT_GAIN * (LEDBAT_TARGET_US - queueing_us) / LEDBAT_TARGET_US *
+			acked / ca->cwnd;
+	// it only grows while the sender fills it (RFC 6817 max_allowed_cwnd):
+	// window the sender is not using would come out later as a burst.  The
+	// increase is capped rather than dropped, or a cwnd just short of a whole
+	// packet would never let the flight grow enough to reach it.
+	max_allowed = rs->prior_flight + LEDBAT_ALLOWED_INCREASE;
+	if (change < 0 || ca->cwnd + change <= max_allowed)
+		ca->cwnd += change;
+	else if (ca->cwnd < max_allowed)
+		ca->cwnd = max_allowed;
+	if (ca->cwnd < LEDBAT_MIN_CWND)
+		ca->cwnd = LEDBAT_MIN_CWND;
+	r->s_cwnd = ca->cwnd;
+}
+
+//Loss halves cwnd, as in TCP (RFC 6817 2.4.2); a timeout restarts from one
+//packet, slow starting back to half
+void ledbat_on_loss(rel_t* r, enum cc_loss kind) {
+	struct ledbat *ca = (struct ledbat*) r->s_cc_priv;
+	uint32_t half = r->s_cwnd / 2 > LEDBAT_MIN_CWND ? r->s_cwnd / 2 : LEDBAT_MIN_CWND;
+
+	if (kind == CC_LOSS_DUPACK) {
+		r->s_ssthresh = half;
+		r->s_cwnd = half;
+	}
+	else {
+		// a second timeout for the same packet keeps the ssthresh of the first
+		if (r->s_rto_backoff == 0)
+			r->s_ssthresh = half;
+		r->s_cwnd = 1;
 	}
-	return temp;
+	ca->cwnd = r->s_cwnd;
+}
+
+const struct cc_ops cc_ledbat = {
+	.name = "ledbat",
+	.init = ledbat_init,
+	.on_ack = ledbat_on_ack,
+	.on_loss = ledbat_on_loss,
+};
+
+// Congestion control algorithms selectable with --cc; the first is the default
+const struct cc_ops *cc_algos[] = {
+	&cc_reno,
+	&cc_cubic,
+	&cc_bbr,
+	&cc_ledbat,
+	NULL
+};
+
+//Looks up a congestion control algorithm by name, NULL meaning the default
+const struct cc_ops *find_cc(const char *name) {
+	int i;
+
+	if (!name)
+		return cc_algos[0];
+	for (i = 0; cc_algos[i]; i++)
+		if (strcmp(cc_algos[i]->name, name) == 0)
+			return cc_algos[i];
+	return NULL;
 }
 
 /* Creates a new reliable protocol session, returns NULL on failure.
@@ -241,6 +1452,14 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 		const struct config_common *cc)
 {
 	rel_t *r;
+	uint32_t size;
+	const struct cc_ops *cc_algo;
+
+	cc_algo = find_cc(cc->cc);
+	if (!cc_algo) {
+		fprintf(stderr, "unknown congestion control algorithm %s\n", cc->cc);
+		return NULL;
+	}
 
 	r = xmalloc (sizeof (*r));
 	memset (r, 0, sizeof (*r));
@@ -254,335 +1473,417 @@ rel_create (conn_t *c, const struct sockaddr_storage *ss,
 	}
 
 	r->c = c;
+	r->next = rel_list;
+	r->prev = &rel_list;
+	if (rel_list)
+		rel_list->prev = &r->next;
 	rel_list = r;
 
 	//Our initialization
 	// sender's view
 	r->s_next_out_pkt_seq = 1;
+	r->s_next_tx_seq = 1;
+	r->s_max_tx_seq = 1;
 	r->s_last_ack_recvd = 1;
 	r->s_cwnd = 25;
 	r->s_rwnd = 25;
 	r->s_ssthresh = cc->window;
-	r->s_timeout = 0;
-	r->s_timeout_reset = 0;
-	r->s_dup_acks = 0;
-	r->s_dup_acks_reset = 0;
+	r->s_cc = cc_algo;
+	r->s_cc->init(r);
 	r->s_dup_ack_count = 0;
+	r->s_in_recovery = 0;
+	r->s_recover = 1;
+	r->s_high_sacked = 1;
+	r->s_high_rxt = 1;
+	r->s_rto_frozen = 0;
+	r->s_delivered = 0;
+	r->s_app_limited = 0;
+	r->s_pace_blocked = 0;
 	r->send_eof = 0;
 
 	// receiver's view
 	r->r_next_exp_seq = 1;
 	r->r_to_print_pkt_seq = 1;
 	r->recv_eof = 0;
+	r->r_owd_us = 0;
+	r->r_rcvbuf_max = cc->window;
+	r->r_rcvbuf = min32(RCVBUF_INIT, r->r_rcvbuf_max);
+	r->r_rtt_seq = 0;
+	r->r_rtt_us = 0;
+	r->r_space_seq = 1;
 
 	// Copied from config_common
-	r->timeout = TIMEOUT;
+	r->s_sndbuf = cc->sndbuf;
+	r->s_rto_min_us = cc->rto_min * 1000L;
+	r->s_rto_max_us = cc->rto_max * 1000L;
+	r->s_pace = cc->pace;
+	r->s_pace_burst = cc->pace_burst;
+
+	// until the first sample, the RTO is the configured timeout
+	r->s_srtt_us = 0;
+	r->s_rttvar_us = 0;
+	r->s_rto_us = cc->timeout * 1000L;
+	r->s_rto_backoff = 0;
+
+	// the ring holds the whole send buffer, so it never has to grow
+	for (size = 1; size < r->s_sndbuf; size *= 2)
+		;
+	init_send_ring(r, size);
+	// the ring can hold the largest receive buffer autotuning may pick
+	for (size = 64; size < r->r_rcvbuf_max; size *= 2)
+		;
+	init_recv_ring(r, size);
 
 	//Send eof at beginning if RECEIVER
 	if (r->c->sender_receiver == RECEIVER) {
 		send_eof(r);
 	}
 
-	r->start = (struct timespec*) malloc(sizeof(struct timespec));
-	clock_gettime (CLOCK_MONOTONIC, r->start);
+	clock_gettime (CLOCK_MONOTONIC, &r->start);
+	r->r_space_time = r->start;
 	return r;
 }
 
 void
 rel_destroy (rel_t *r)
 {
+	uint32_t slot;
+
 	conn_destroy (r->c);
 
 	/* Free any other allocated memory here */
-
-	struct timespec* end = (struct timespec*) malloc(sizeof(struct timespec));
-	clock_gettime (CLOCK_MONOTONIC, end);
-	struct timespec* diff = (struct timespec*) malloc(sizeof(struct timespec));
-	timespec_subtract(diff, end, r->start);
-	fprintf(stderr, "Time elapsed: %ld secs and %ld nanoseconds", diff->tv_sec, diff->tv_nsec);
+	release_acked(r, r->s_next_out_pkt_seq);
+	free(r->s_ring_pkt);
+	free(r->s_ring_size);
+	free(r->s_ring_sent);
+	free(r->s_ring_retx);
+	free(r->s_ring_sacked);
+	free(r->s_ring_rate);
+
+	for (slot = 0; slot <= r->r_ring_mask; slot++)
+		if (is_present(r, slot))
+			remove_from_recv_ring(r, slot);
+	free(r->r_ring_pkt);
+	free(r->r_ring_len);
+	free(r->r_present);
+
+	if (r->next)
+		r->next->prev = r->prev;
+	*r->prev = r->next;
+
+	struct timespec end, diff;
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	timespec_subtract(&diff, &end, &r->start);
+	fprintf(stderr, "Time elapsed: %ld secs and %ld nanoseconds\n", diff.tv_sec, diff.tv_nsec);
+	fprintf(stderr, "Packet pool: %lu packets handed out from %lu chunk allocations\n",
+			r->c->pool_nallocs, r->c->pool_nchunks);
 	fflush(stderr);
+	free(r);
 }
 
 
-void 
-update_window_size (rel_t *r) {
-
-	if (r->s_timeout_reset == 1) { 
-		r->s_dup_acks = 0;
-		r->s_timeout = 1;
-	}
-	if (r->s_dup_acks_reset == 1) {
-		r->s_timeout = 0; 
-		r->s_dup_acks = 1;
+//Destroys the connection once both directions are finished: we have sent and
+//received EOF, everything we sent is acked and everything received is output
+void close_if_done(rel_t* r) {
+	if (r->send_eof > 0
+		&& r->recv_eof > 0
+		&& r->s_last_ack_recvd == r->s_next_out_pkt_seq
+		&& r->r_to_print_pkt_seq == r->r_next_exp_seq) {
+		rel_destroy(r);
 	}
+}
 
-	if (r -> s_dup_acks == 0 && r -> s_timeout == 0 ){
-		r -> s_cwnd += 1; //AI
+//Handles an ack that moved s_last_ack_recvd up to ackno, `acked` packets,
+//with `flight` packets outstanding before it.  Recovery ends as in NewReno
+//(RFC 6582 3.2); while it lasts send_recovery does the sending.
+void new_ack(rel_t* r, uint32_t ackno, uint32_t acked, uint32_t flight) {
+	r->s_dup_ack_count = 0;
 
-	} else if (r->s_dup_acks == 1) {
-		if (r->s_dup_acks_reset == 1) {
-			r->s_ssthresh = r->s_cwnd/2;
-			r->s_cwnd = r->s_ssthresh;
-			r->s_dup_acks_reset = 0;
-		} else {
-			r->s_cwnd += 1;
-		} 
+	if (!r->s_in_recovery)
+		return;
 
-		//end of recovery from dup acks
-		if (r -> s_cwnd >= r -> s_ssthresh){
-			r -> s_dup_acks = 0;
-		}
-		
-	} else if (r->s_timeout == 1) {
-		if (r->s_timeout_reset == 1) {
-			r->s_ssthresh = r->s_cwnd/2;
-			r->s_cwnd = 1;
-			r->s_timeout_reset = 0;
-		} else if (r->s_ssthresh > r->s_cwnd) {
-			r->s_cwnd *= 2; 		//slow start 
-		} else {
-			r->s_cwnd+= 1; 		//AIMD
-		}
+	if (ackno - r->s_recover < 0x80000000) {
+		// full ack: leave recovery with the window deflated to ssthresh, or to
+		// what is actually in flight if that is smaller
+		flight = r->s_next_tx_seq - ackno;
+		r->s_cwnd = flight + 1 < r->s_ssthresh ? flight + 1 : r->s_ssthresh;
+		r->s_in_recovery = 0;
+		if (opt_debug)
+			fprintf(stderr, "recovered at %u: cwnd %u\n", ackno, r->s_cwnd);
+		return;
+	}
 
-		//end of recovery from timeout
-		if (r -> s_cwnd >= r -> s_ssthresh) {
-			r -> s_timeout = 0;
-		}
+	// only the first partial ack restarts the timer (see timer_start)
+	r->s_rto_frozen = 1;
+	if (ackno - r->s_high_rxt < 0x80000000) {
+		// partial ack for a hole not retransmitted yet: it was lost too, even
+		// if it lies beyond what the SACK bitmaps could report
+		retransmit(r, ackno);
+		r->s_high_rxt = ackno + 1;
+		if (opt_debug)
+			fprintf(stderr, "partial ack %u: retransmit\n", ackno);
 	}
 }
 
+//Handles a duplicate ack: the third starts fast retransmit and recovery,
+//unless it is for data sent before the last recovery or timeout began.  The
+//window is not inflated; send_recovery counts SACKed packets out of the pipe.
+void dup_ack(rel_t* r) {
+	r->s_dup_ack_count++;
+
+	if (r->s_in_recovery || r->s_dup_ack_count != DUPTHRESH ||
+			r->s_last_ack_recvd - r->s_recover >= 0x80000000)
+		return;
+
+	r->s_cc->on_loss(r, CC_LOSS_DUPACK);
+	r->s_in_recovery = 1;
+	r->s_rto_frozen = 0;
+	r->s_recover = r->s_max_tx_seq;
+	retransmit(r, r->s_last_ack_recvd);
+	r->s_high_rxt = r->s_last_ack_recvd + 1;
+	if (opt_debug)
+		fprintf(stderr, "fast retransmit %u: ssthresh %u, recover %u\n",
+				r->s_last_ack_recvd, r->s_ssthresh, r->s_recover);
+}
+
 
-// Process a received packet
+// Process a received packet, which is ours to keep or free
 void
 rel_recvpkt (rel_t *r, packet_t *pkt, size_t n)
 {
+	uint32_t ackno;
+	struct rate_sample rs;
+	struct timespec now;
+	int kept = 0;
+
 	// Verify checksum; abort if necessary
 	uint16_t cksum_recv = pkt->cksum;
 	pkt->cksum = 0x0000;
 	uint16_t cksum_calc = cksum ((void*) pkt, min(ntohs(pkt->len), n));
 	if (cksum_recv != cksum_calc) {
+		conn_pktfree(r->c, pkt);
 		send_ack(r);
 		return;
 	}
 
 	// Update s_last_ack_recvd for sender state
-	if (ntohl(pkt->ackno) > r->s_last_ack_recvd && ntohl(pkt->ackno) <= r->s_next_out_pkt_seq){
-		//Check for dup acks
-		if (ntohl(pkt->ackno) == r->s_last_ack_recvd) { 
-			r->s_dup_ack_count++;
-			if (r->s_dup_ack_count == 3) {
-				r->s_dup_acks_reset = 1;
-				r->s_dup_ack_count = 0;
-			}
-		} else {
-			r->s_dup_ack_count = 0; 
+	ackno = ntohl(pkt->ackno);
+	memset(&rs, 0, sizeof(rs));
+	rs.prior_flight = r->s_next_tx_seq - r->s_last_ack_recvd;
+	rs.rtt_us = -1;
+	if (n >= ACK_SIZE && n < HEADER_SIZE && ntohs(pkt->len) >= ACK_SIZE)
+		rs.owd_us = ntohl(((struct ack_packet*) pkt)->delay);
+	if (ackno > r->s_last_ack_recvd && ackno <= r->s_max_tx_seq){
+		rs.acked = ackno - r->s_last_ack_recvd;
+
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		if (!r->s_in_recovery || !r->s_rto_frozen)
+			r->s_rto_restart = now;
+		if ((rs.rtt_us = sample_rtt(r, ackno, &now)) >= 0)
+			update_rto(r, rs.rtt_us);
+		deliver_acked(r, ackno, &rs, &now);
+		release_acked(r, ackno);
+		if (n >= SACK_ACK_SIZE && n < HEADER_SIZE && ntohs(pkt->len) >= SACK_ACK_SIZE)
+			update_scoreboard(r, (struct ack_packet*) pkt, &rs, &now);
+		rate_finish(r, &rs);
+		r->s_cc->on_ack(r, &rs);
+		new_ack(r, ackno, rs.acked, rs.prior_flight);
+
+		// room in the send buffer again, so resume reading input
+		if (r->c->xoff && !r->send_eof)
+			read_input(r);
+	}
+	//Check for dup acks: a pure ack that neither moves nor resizes the window
+	//while data is outstanding (RFC 5681 2).  It must also SACK new data (RFC
+	//6675 2): the peer answers duplicates of delivered packets, such as the
+	//resends after a timeout, with the same ack, and those say nothing of loss.
+	else if (ackno == r->s_last_ack_recvd && n < HEADER_SIZE &&
+			ntohl(pkt->rwnd) == r->s_rwnd && r->s_max_tx_seq != r->s_last_ack_recvd) {
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		if (n >= SACK_ACK_SIZE && ntohs(pkt->len) >= SACK_ACK_SIZE &&
+				update_scoreboard(r, (struct ack_packet*) pkt, &rs, &now) > 0) {
+			dup_ack(r);
+			rate_finish(r, &rs);
+			r->s_cc->on_ack(r, &rs);
 		}
-		r->s_last_ack_recvd = ntohl(pkt->ackno);
 	}
 	
 	//update window size
-	r->s_rwnd = ntohl(pkt->rwnd);
-	update_window_size(r);
+	// a zero window still lets one packet through, which probes for a reopened
+	// window in case the ack announcing it got lost
+	r->s_rwnd = ntohl(pkt->rwnd) ? ntohl(pkt->rwnd) : 1;
+
+	// the ack may have opened the window for queued packets
+	send_pending(r);
 
 	// Received data packet
-	if (n >= HEADER_SIZE && ntohs(pkt->len) >= HEADER_SIZE && ntohl(pkt->seqno) == r->r_next_exp_seq) {
+	if (n >= HEADER_SIZE && ntohs(pkt->len) >= HEADER_SIZE) {
+		// the acks it prompts report how long it took to get here
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		r->r_owd_us = timestamp_us(&now) - ntohl(pkt->tsval);
+		if (r->r_owd_us == 0)
+			r->r_owd_us = 1;
+
 		// Discard garbage pkt, out of the receiving window
 		if (ntohl(pkt->seqno) < r->r_next_exp_seq ||
-			ntohl(pkt->seqno) >= (r->r_next_exp_seq + (conn_bufspace(r->c))/MSS)) {
+			ntohl(pkt->seqno) - r->r_to_print_pkt_seq > r->r_ring_mask) {
 			send_ack(r);
-			return;
 		}
-
-		// add to in_pkt_list
-		add_to_in_list(r, pkt, n);
-
-		// update r_next_exp_seq
-		while (get_in_pkt(r->r_next_exp_seq) != NULL)
-			r->r_next_exp_seq++;
-
-		//Received EOF
-		if (ntohs(pkt->len) == HEADER_SIZE) {
-			r->recv_eof = 1;
-			send_ack(r);
+		else {
+			// buffer it, even if it arrived out of order; the ring takes the
+			// packet itself, and frees it once it has been output
+			kept = add_to_recv_ring(r, pkt, min(ntohs(pkt->len), n));
+
+			// update r_next_exp_seq past every packet we now hold in order
+			r->r_next_exp_seq += count_present(r, r->r_next_exp_seq,
+					r->r_to_print_pkt_seq + r->r_ring_mask + 1 - r->r_next_exp_seq);
+
+			// Try to output
+			output_data(r);
+			tune_rcvbuf(r);
 		}
-
-
-		// Try to output
-		rel_output(r);
 	}
+
+	if (!kept)
+		conn_pktfree(r->c, pkt);
+	close_if_done(r);
 }
 
+//Reads input into the send buffer and sends what the window allows
 void
-rel_read (rel_t *s)
+read_input (rel_t *s)
 {
 	if (s->c->sender_receiver == RECEIVER) {
 		send_eof(s);
 	}
 	else {
-		//Prepare packet
-		packet_t *to_send = (packet_t*) malloc(sizeof(packet_t));
-		to_send->cksum = 0x0000;
-		to_send->ackno = htonl(s->r_next_exp_seq);
-		to_send->seqno = htonl(s->s_next_out_pkt_seq);
-		to_send->rwnd = htonl((conn_bufspace(s->c))/MSS);
-
-		//Get user input
-		int conn_input_return = conn_input (s->c, (void*) to_send->data, PACKET_SIZE-HEADER_SIZE);
+		//Read as much input as the send buffer has room for.  Once it is full we
+		//stop calling conn_input, so reading stays paused (c->xoff) until acks
+		//free up space and rel_recvpkt calls us again.
+		while (!s->send_eof && s->s_next_out_pkt_seq - s->s_last_ack_recvd < s->s_sndbuf) {
+			//Prepare packet
+			packet_t *to_send = conn_pktalloc(s->c);
+			to_send->cksum = 0x0000;
+			to_send->ackno = htonl(s->r_next_exp_seq);
+			to_send->seqno = htonl(s->s_next_out_pkt_seq);
+			to_send->tsval = 0;
+			to_send->rwnd = htonl(recv_window(s));
+
+			//Get user input
+			int conn_input_return = conn_input (s->c, (void*) to_send->data, PACKET_SIZE-HEADER_SIZE);
+
+			//User entered data
+			if (conn_input_return > 0) {
+				//Calculate fields
+				to_send->len = htons(conn_input_return + HEADER_SIZE);
+				to_send->cksum = cksum ((void*) to_send, HEADER_SIZE + conn_input_return);
+
+				add_to_send_ring(s, to_send, HEADER_SIZE + conn_input_return);
+			}
+			//No data currently available
+			else if (conn_input_return == 0) {
+				conn_pktfree(s->c, to_send);
+				break;
+			}
+			//Send EOF
+			else if (conn_input_return == -1) {
+				//Calculate fields
+				to_send->len = htons(HEADER_SIZE);
+				to_send->cksum = cksum ((void*) to_send, HEADER_SIZE);
 
-		//User entered data
-		if (conn_input_return > -1) {
-			//Calculate fields
-			to_send->len = htons(conn_input_return + HEADER_SIZE);
-			to_send->cksum = cksum ((void*) to_send, HEADER_SIZE + conn_input_return);
+				//Record
+				s->send_eof = 1;
 
-			//Send if possible
-			if (s->s_next_out_pkt_seq - s->s_last_ack_recvd < min32(s->s_cwnd, s->s_rwnd))
-				conn_sendpkt (s->c, to_send, HEADER_SIZE + conn_input_return);
+				add_to_send_ring(s, to_send, HEADER_SIZE);
+			}
 
-			struct timespec *timespec = (struct timespec*) malloc(sizeof(struct timespec));
-			clock_gettime (CLOCK_MONOTONIC, timespec);
-			add_to_out_list(s, to_send, s->s_next_out_pkt_seq, HEADER_SIZE + conn_input_return, timespec);
-		}
-		//No data currently available
-		else if (conn_input_return == 0) { 
-			return;
-		}
-		//Send EOF
-		else if (conn_input_return == -1) {
-			//Calculate fields
-			to_send->len = htons(HEADER_SIZE);
-			to_send->cksum = cksum ((void*) to_send, HEADER_SIZE);
-
-			//Record
-			s->send_eof = 1;
-
-			//Send and add to list
-			conn_sendpkt (s->c, to_send, HEADER_SIZE);
-			struct timespec *timespec = (struct timespec*) malloc(sizeof(struct timespec));
-			clock_gettime (CLOCK_MONOTONIC, timespec);
-			add_to_out_list(s, to_send, s->s_next_out_pkt_seq, HEADER_SIZE, timespec);
+			//Increment sequence number
+			s->s_next_out_pkt_seq++;
 		}
 
-		//Increment sequence number
-		s->s_next_out_pkt_seq++;
+		//Send if the window allows
+		send_pending(s);
 	}
 }
 
+void
+rel_read (rel_t *s)
+{
+	read_input(s);
+	close_if_done(s);
+}
+
 //Output received data
 void
-rel_output (rel_t *r)
+output_data (rel_t *r)
 {
-	int conn_output_return = 1;
-	while (conn_output_return > 0) {
-		//Look for packet to output
-		in_pkt_t* temp = get_in_pkt(r->r_to_print_pkt_seq);
+	int conn_output_return;
+	uint32_t slot;
 
-		//Ack for packet we looked for
-		if (temp == NULL) {
-			send_ack(r);
-			return;
-		}
+	while (r->r_to_print_pkt_seq != r->r_next_exp_seq) {
+		slot = r->r_to_print_pkt_seq & r->r_ring_mask;
 
 		//Try to output
-		conn_output_return = conn_output(r->c, (void*)temp->pkt->data, temp->len - temp->progress);
+		conn_output_return = conn_output(r->c, (void*)(r->r_ring_pkt[slot]->data + r->r_progress),
+				r->r_ring_len[slot] - r->r_progress);
+		if (conn_output_return < 0)
+			break;
+
+		//Received EOF
+		if (r->r_ring_len[slot] == 0)
+			r->recv_eof = 1;
+		else if (conn_output_return == 0)
+			break;
 
 		//Record progress
-		if (conn_output_return > 0) {
-			temp->progress += conn_output_return;
-		}
-		if (conn_output_return == 0) {}
-		if (conn_output_return == -1) {}
+		r->r_progress += conn_output_return;
 
 		//If done with this packet, move on to next packet
-		if (temp->progress == temp->len) {
+		if (r->r_progress == r->r_ring_len[slot]) {
+			remove_from_recv_ring(r, r->r_to_print_pkt_seq);
 			r->r_to_print_pkt_seq++;
+			r->r_progress = 0;
 		}
 	}
+
+	//Ack what we have so far
+	send_ack(r);
 }
 
 void
-clean_in_pkt_list(){
-	//clean in_pkt_list
-	in_pkt_t* curr = in_list_head;
-	in_pkt_t* prev = NULL;
-	while(curr){
-		if ( curr-> seqno < curr -> r -> r_to_print_pkt_seq ){
-			//already printed pkt, remove
-			if (!prev) {
-				// remove head
-				in_pkt_t* to_free = curr;
-				in_list_head = curr -> next;
-				curr = in_list_head;
-				free(to_free);
-
-			} else {
-				in_pkt_t* to_free = curr;
-				curr = curr -> next;
-				prev -> next = curr;
-				free(to_free);
-			}
-
-		} else {
-			prev = curr;
-			curr = curr -> next;
-		}
-	} 
+rel_output (rel_t *r)
+{
+	output_data(r);
+	close_if_done(r);
 }
 
-
-// Retransmit any packets that need to be retransmitted
+// The oldest unacked packet has gone unacknowledged for a whole RTO: collapse
+// the window to one packet and go back to it, resending everything after it in
+// slow start as acks come back (RFC 5681 3.1)
 void
-rel_timer () {
-	out_pkt_t *temp = out_list_head;
-	out_pkt_t *prev = NULL;
-	while (temp) {
-
-		// If unacked + window is satisfied + timeout, resend
-		if (temp->seqno >= temp->r->s_last_ack_recvd &&
-				temp->seqno - temp->r->s_last_ack_recvd < min32(temp->r->s_cwnd, temp->r->s_rwnd) &&
-				time_until_timeout(temp->last_try, (long) temp->r->timeout) == 0)
-		{
-			conn_sendpkt (temp->r->c, temp->pkt, temp->size);
-			clock_gettime(CLOCK_MONOTONIC, temp->last_try);
-			//temp->r->s_timeout_reset = 1;
-			update_window_size(temp->r);
-		}
-
-		//remove the pkt if needed, otherwise just move on
-		if (temp -> seqno < temp -> r -> s_last_ack_recvd){
-			if (!prev) {
-				// remove head
-				out_pkt_t* to_free = temp;
-				out_list_head = temp -> next;
-				temp = out_list_head;
-				free(to_free);
-			} else {
-				// remove node
-				out_pkt_t* to_free = temp;
-				temp = temp -> next;
-				prev -> next = temp;
-				free(to_free);
-			}
-
-		} else {
-			//nothing to remove, move on
-			prev = temp;
-			temp = temp->next;
-		}
-
+rel_timer (rel_t *r) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// not a timeout: pacing let a packet go, or an ack restarted the timer
+	if (r->s_last_ack_recvd == r->s_next_tx_seq ||
+			timespec_diff_us(timer_start(r), &now) < current_rto(r)) {
+		send_pending(r);
+		return;
 	}
 
-	//clean in_pkt_list
-	clean_in_pkt_list();
+	r->s_cc->on_loss(r, CC_LOSS_TIMEOUT);
+	r->s_dup_ack_count = 0;
+	r->s_in_recovery = 0;
+	r->s_recover = r->s_max_tx_seq;
+	r->s_next_tx_seq = r->s_last_ack_recvd;
 
-	//If necessary, close connection
-	rel_t *temp_rel = rel_list;
-	if (temp_rel -> send_eof > 0
-		&& temp_rel -> recv_eof > 0
-		&& temp_rel->s_last_ack_recvd == temp_rel->s_next_out_pkt_seq
-		&& temp_rel->r_to_print_pkt_seq == temp_rel->r_next_exp_seq) {
-		rel_destroy(temp_rel);
-	}
+	r->s_rto_backoff++;
+	if (opt_debug)
+		fprintf(stderr, "timeout at %u: ssthresh %u, rto backed off to %ld us\n",
+				r->s_last_ack_recvd, r->s_ssthresh, current_rto(r));
+
+	send_pending(r);
 }
 
 void
@@ -1,5 +1,6 @@
 /* rlib version 4 */
 
+#define _GNU_SOURCE		/* for sendmmsg and recvmmsg */
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -14,9 +15,15 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
 #include <signal.h>
 #include <sys/stat.h>
+#if URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* URING */
 
 #include "rlib.h"
 
@@ -46,19 +53,52 @@ struct config_server {
 
 static struct config_server *serverconf;
 
-static void conn_mkevents (void);
-static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-		       struct sockaddr_storage *from);
-
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
+/* The event loop watches file descriptors with epoll, and only looks
+ * at the connections that something happened to: those epoll reports
+ * ready, and those on the dirty list, whose watches or send queues
+ * changed since conn_poll last brought them up to date.  A watch holds
+ * the events epoll is watching for on a descriptor, or one of: */
+#define EV_UNWATCHED -1
+#define EV_DEAD -2		/* hung up or failed; watched no more */
+#define EV_FILE 0x40000000	/* epoll refuses regular files, which are
+				   always ready, as poll reports them */
+#define EVBATCH_MAX 64
+
+static int epfd = -1;
+static conn_t **evconns;	/* connection watching each fd, by fd */
+static int nevconns;
+static int nfiles;		/* watches flagged EV_FILE */
+static conn_t *conn_dirty;
+
+#if URING
+static void ur_probe (conn_t *c);
+static void ur_readahead (conn_t *c);
+static int ur_ready (conn_t *c);
+static void ur_flush (conn_t *c);
+static void ur_release (conn_t *c);
+static void ur_submit (void);
+static void ur_reap (void);
+static void ur_init (void);
+static int ur_input (conn_t *c, void *buf, size_t n);
+static int ur_output (conn_t *c, const char *buf, size_t n);
+#define conn_outpending(c) ((c)->outq || (c)->ur_outbytes)
+#else /* !URING */
+#define conn_outpending(c) ((c)->outq != NULL)
+#endif /* !URING */
+
+/* The listening socket of a client or the UDP socket of a server */
+static int mainfd = -1;
+static int mainwatch = EV_UNWATCHED;
+static int mainready;		/* set when conn_poll saw mainfd ready */
 
 
 static conn_t *conn_list;
-struct timespec last_timeout;
+
+/* Armed connection timers, as a binary min-heap on timer_at.  The heap
+ * is 1-based so that a timer_idx of 0 can mean "not armed". */
+static conn_t **timerq;
+static int ntimerq;
+static int timerq_size;
 
 #if !DMALLOC
 void *
@@ -106,32 +146,733 @@ print_pkt (const packet_t *buf, const char *op, int n)
     if (errno != EAGAIN)
       fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
   }
-  else if (n == 12)
-    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d\n",
-	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno), ntohl(buf->rwnd));
-  else if (n >= 16)
+  else if (n == 19) {
+    const struct ack_packet *ack = (const struct ack_packet *) buf;
+    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d, delay = %u, sack = %02x%02x%02x\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno), ntohl(buf->rwnd),
+	     ntohl (ack->delay), ack->sack[2], ack->sack[1], ack->sack[0]);
+  }
+  else if (n >= 16 && n < 19) {
+    const struct ack_packet *ack = (const struct ack_packet *) buf;
+    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d, delay = %u\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno), ntohl(buf->rwnd),
+	     ntohl (ack->delay));
+  }
+  else if (n >= 20)
     fprintf (stderr,
-	     "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x, rwnd = %d\n",
+	     "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x, rwnd = %d, tsval = %u\n",
 	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
-	     ntohl (buf->seqno), ntohl(buf->rwnd));
+	     ntohl (buf->seqno), ntohl(buf->rwnd), ntohl (buf->tsval));
   else
     fprintf (stderr, "%5d %s(%3d):\n", pid, op, n);
   errno = saved_errno;
 }
 
+/* Brings the watch on fd up to date with the events wanted, a mask of
+ * EPOLLIN and EPOLLOUT or EV_UNWATCHED.  epoll still reports errors and
+ * hangups on a descriptor watched for no events. */
+static void
+ev_watch (conn_t *c, int fd, int *watch, int want)
+{
+  struct epoll_event ev;
+  int op;
+
+  if (*watch == want || *watch == EV_DEAD)
+    return;
+  if (*watch >= 0 && (*watch & EV_FILE)) {
+    if (want < 0)
+      nfiles--;
+    *watch = want < 0 ? want : EV_FILE | want;
+    return;
+  }
+
+  op = want < 0 ? EPOLL_CTL_DEL
+    : *watch < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = want < 0 ? 0 : want;
+  ev.data.fd = fd;
+  if (epoll_ctl (epfd, op, fd, &ev) < 0) {
+    if (op == EPOLL_CTL_ADD && errno == EPERM) {
+      nfiles++;
+      *watch = EV_FILE | want;
+      return;
+    }
+    if (op != EPOLL_CTL_DEL)
+      perror ("epoll_ctl");
+  }
+  if (op == EPOLL_CTL_ADD) {
+    if (fd >= nevconns) {
+      int n = nevconns ? nevconns : 64;
+      while (n <= fd)
+	n *= 2;
+      evconns = realloc (evconns, n * sizeof (*evconns));
+      if (!evconns) {
+	fprintf (stderr, "%s: out of memory\n", progname);
+	abort ();
+      }
+      memset (evconns + nevconns, 0, (n - nevconns) * sizeof (*evconns));
+      nevconns = n;
+    }
+    evconns[fd] = c;
+  }
+  else if (op == EPOLL_CTL_DEL && fd < nevconns)
+    evconns[fd] = NULL;
+  *watch = want;
+}
+
+/* Sets the watches on a connection's descriptors to what it wants now. */
+static void
+conn_watch (conn_t *c)
+{
+  int rwant, wwant;
+
+  rwant = c->read_eof ? EV_UNWATCHED
+    : c->xoff || c->delete_me ? 0 : EPOLLIN;
+  wwant = c->write_err ? EV_UNWATCHED : c->outq ? EPOLLOUT : 0;
+#if URING
+  if (!c->ur_probed)
+    ur_probe (c);
+  if (c->ur_rd) {
+    ur_readahead (c);
+    if (rwant > 0 && !ur_ready (c))
+      rwant = 0;
+  }
+  if (c->ur_wr)
+    ur_flush (c);
+#endif /* URING */
+  if (c->wfd == c->rfd) {
+    if (rwant < 0)
+      rwant = wwant;
+    else if (wwant > 0)
+      rwant |= wwant;
+  }
+  else
+    ev_watch (c, c->wfd, &c->wwatch, wwant);
+  ev_watch (c, c->rfd, &c->rwatch, rwant);
+  if (!c->server)
+    ev_watch (c, c->nfd, &c->nwatch, EPOLLIN | (c->ntxq ? EPOLLOUT : 0));
+}
+
+/* Puts c on the dirty list, for conn_poll to send its queued packets,
+ * update its watches, or free it once deleted. */
+static void
+conn_touch (conn_t *c)
+{
+  if (c->dirty)
+    return;
+  c->dirty = 1;
+  c->dirty_next = conn_dirty;
+  conn_dirty = c;
+}
+
+#if URING
+/* io_uring reads and writes regular files, which epoll cannot wait on,
+ * in IOBLK_SIZE blocks of one registered arena, and the files go in a
+ * fixed file table at the slot of their fd.  Each pass of conn_poll
+ * submits what the last one queued with a single io_uring_enter, and
+ * epoll wakes the loop for completions through the ring's fd. */
+#define IOBLK_SIZE 65536
+#define IOBLK_MAX 64		/* blocks in the arena */
+#define UR_READAHEAD 4		/* blocks a connection reads ahead */
+#define UR_WRITEBEHIND 4	/* blocks of output it may have pending */
+#define UR_ENTRIES 256
+#define UR_NFILES 256
+
+struct ioblk {
+  struct ioblk *next;
+  conn_t *c;			/* NULL once c is freed */
+  char *buf;			/* IOBLK_SIZE bytes of the arena */
+  size_t len;			/* bytes read into, or staged in, buf */
+  size_t done;			/* bytes consumed, or written out */
+  off_t off;			/* file offset of buf[0] */
+  char write;			/* output rather than input */
+  char busy;			/* submitted, not yet completed */
+  char eof;			/* the file ends in this block */
+  int err;			/* errno of a failed read */
+};
+
+static struct {
+  int fd;
+  int watch;
+  unsigned *sqtail, *sqarray, sqmask, sqentries, tail, pending;
+  unsigned *cqhead, *cqtail, cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  struct ioblk blks[IOBLK_MAX];
+  struct ioblk *free;
+} ur = { -1, EV_UNWATCHED };
+
+static void
+ur_init (void)
+{
+  struct io_uring_params p;
+  struct iovec iov;
+  int files[UR_NFILES];
+  size_t sqsize, cqsize;
+  char *sq, *cq, *arena;
+  int i;
+
+  memset (&p, 0, sizeof (p));
+  ur.fd = syscall (__NR_io_uring_setup, UR_ENTRIES, &p);
+  if (ur.fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP))
+    goto fail;
+  sqsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  cqsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  sq = cq = mmap (NULL, sqsize > cqsize ? sqsize : cqsize,
+		  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ur.fd, IORING_OFF_SQ_RING);
+  ur.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+		  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ur.fd, IORING_OFF_SQES);
+  arena = mmap (NULL, IOBLK_MAX * IOBLK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (sq == MAP_FAILED || ur.sqes == MAP_FAILED || arena == MAP_FAILED)
+    goto fail;
+  ur.sqtail = (unsigned *) (sq + p.sq_off.tail);
+  ur.sqarray = (unsigned *) (sq + p.sq_off.array);
+  ur.sqmask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  ur.sqentries = p.sq_entries;
+  ur.tail = *ur.sqtail;
+  ur.cqhead = (unsigned *) (cq + p.cq_off.head);
+  ur.cqtail = (unsigned *) (cq + p.cq_off.tail);
+  ur.cqmask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  ur.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  iov.iov_base = arena;
+  iov.iov_len = IOBLK_MAX * IOBLK_SIZE;
+  for (i = 0; i < UR_NFILES; i++)
+    files[i] = -1;
+  if (syscall (__NR_io_uring_register, ur.fd, IORING_REGISTER_BUFFERS,
+	       &iov, 1) < 0
+      || syscall (__NR_io_uring_register, ur.fd, IORING_REGISTER_FILES,
+		  files, UR_NFILES) < 0)
+    goto fail;
+  for (i = 0; i < IOBLK_MAX; i++) {
+    ur.blks[i].buf = arena + i * IOBLK_SIZE;
+    ur.blks[i].next = ur.free;
+    ur.free = &ur.blks[i];
+  }
+  ev_watch (NULL, ur.fd, &ur.watch, EPOLLIN);
+  return;
+
+ fail:
+  if (opt_debug)
+    perror ("io_uring, using plain reads and writes");
+  if (ur.fd >= 0)
+    close (ur.fd);
+  ur.fd = -1;
+}
+
+/* Points sqe at fd, through the fixed file table if fd has a slot. */
+static void
+ur_setfd (struct io_uring_sqe *sqe, int fd)
+{
+  sqe->fd = fd;
+  if (fd < UR_NFILES)
+    sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+/* Gives fd the fixed file slot at its number, or takes it away. */
+static void
+ur_register (int fd, int on)
+{
+  struct io_uring_files_update up;
+  int f = on ? fd : -1;
+
+  if (fd >= UR_NFILES)
+    return;
+  memset (&up, 0, sizeof (up));
+  up.offset = fd;
+  up.fds = (uintptr_t) &f;
+  syscall (__NR_io_uring_register, ur.fd, IORING_REGISTER_FILES_UPDATE,
+	   &up, 1);
+}
+
+static void
+ur_submit (void)
+{
+  int n;
+
+  if (!ur.pending)
+    return;
+  __atomic_store_n (ur.sqtail, ur.tail, __ATOMIC_RELEASE);
+  n = syscall (__NR_io_uring_enter, ur.fd, ur.pending, 0, 0, NULL, 0);
+  if (n < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      perror ("io_uring_enter");
+    return;
+  }
+  ur.pending -= n;
+}
+
+/* Queues a read or write of what is left of b. */
+static void
+ur_queue (struct ioblk *b)
+{
+  struct io_uring_sqe *sqe;
+
+  if (ur.pending == ur.sqentries)
+    ur_submit ();
+  sqe = &ur.sqes[ur.tail & ur.sqmask];
+  memset (sqe, 0, sizeof (*sqe));
+  if (b->write) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    ur_setfd (sqe, b->c->wfd);
+    sqe->off = b->off + b->done;
+    sqe->addr = (uintptr_t) (b->buf + b->done);
+    sqe->len = b->len - b->done;
+  }
+  else {
+    sqe->opcode = IORING_OP_READ_FIXED;
+    ur_setfd (sqe, b->c->rfd);
+    sqe->off = b->off + b->len;
+    sqe->addr = (uintptr_t) (b->buf + b->len);
+    sqe->len = IOBLK_SIZE - b->len;
+  }
+  sqe->user_data = (uintptr_t) b;
+  ur.sqarray[ur.tail & ur.sqmask] = ur.tail & ur.sqmask;
+  ur.tail++;
+  ur.pending++;
+  b->busy = 1;
+}
+
+static struct ioblk *
+ur_getblk (conn_t *c, int write)
+{
+  struct ioblk *b = ur.free;
+  char *buf;
+
+  if (b) {
+    ur.free = b->next;
+    buf = b->buf;
+    memset (b, 0, sizeof (*b));
+    b->buf = buf;
+    b->c = c;
+    b->write = write;
+  }
+  return b;
+}
+
+static void
+ur_putblk (struct ioblk *b)
+{
+  b->next = ur.free;
+  ur.free = b;
+}
+
+/* Decides whether c's files go through io_uring: regular files whose
+ * offsets can be tracked, but not appended to. */
+static void
+ur_probe (conn_t *c)
+{
+  struct stat sb;
+  off_t off;
+
+  c->ur_probed = 1;
+  if (ur.fd < 0)
+    return;
+  if (!fstat (c->rfd, &sb) && S_ISREG (sb.st_mode)
+      && (off = lseek (c->rfd, 0, SEEK_CUR)) >= 0) {
+    c->ur_rd = 1;
+    c->ur_inoff = off;
+    ur_register (c->rfd, 1);
+  }
+  if (c->wfd != c->rfd && !fstat (c->wfd, &sb) && S_ISREG (sb.st_mode)
+      && !(fcntl (c->wfd, F_GETFL) & O_APPEND)
+      && (off = lseek (c->wfd, 0, SEEK_CUR)) >= 0) {
+    c->ur_wr = 1;
+    c->ur_outoff = off;
+    ur_register (c->wfd, 1);
+  }
+}
+
+/* Keeps UR_READAHEAD blocks of c's input read or being read. */
+static void
+ur_readahead (conn_t *c)
+{
+  struct ioblk *b;
+
+  while (!c->read_eof && !c->delete_me && !c->ur_eof
+	 && c->ur_nin < UR_READAHEAD
+	 && (b = ur_getblk (c, 0))) {
+    b->off = c->ur_inoff;
+    c->ur_inoff += IOBLK_SIZE;
+    if (c->ur_in)
+      c->ur_inlast->next = b;
+    else
+      c->ur_in = b;
+    c->ur_inlast = b;
+    c->ur_nin++;
+    ur_queue (b);
+  }
+}
+
+/* The file is ready to read once the next block is in. */
+static int
+ur_ready (conn_t *c)
+{
+  return !c->ur_in || !c->ur_in->busy;
+}
+
+/* Like read, from the blocks read ahead. */
+static int
+ur_input (conn_t *c, void *buf, size_t n)
+{
+  struct ioblk *b = c->ur_in;
+  int r;
+
+  if (!b) {
+    if (c->ur_eof)
+      return 0;
+    /* The arena ran dry, so read directly. */
+    r = pread (c->rfd, buf, n, c->ur_inoff);
+    if (r > 0)
+      c->ur_inoff += r;
+    return r;
+  }
+  if (b->busy) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (b->err) {
+    errno = b->err;
+    return -1;
+  }
+  if (b->done == b->len)
+    return 0;			/* an empty block past the end */
+
+  r = n < b->len - b->done ? n : b->len - b->done;
+  memcpy (buf, b->buf + b->done, r);
+  b->done += r;
+  if (b->done == b->len && !b->eof) {
+    c->ur_in = b->next;
+    c->ur_nin--;
+    ur_putblk (b);
+    ur_readahead (c);
+  }
+  return r;
+}
+
+/* Like write, into blocks written behind.  Returns the number of bytes
+ * taken, which is 0 while UR_WRITEBEHIND blocks are pending. */
+static int
+ur_output (conn_t *c, const char *buf, size_t n)
+{
+  struct ioblk *b = c->ur_outlast;
+  size_t done = 0, k;
+  int r;
+
+  while (done < n) {
+    if (!b || b->busy || b->len == IOBLK_SIZE) {
+      if (c->ur_nout == UR_WRITEBEHIND || !(b = ur_getblk (c, 1)))
+	break;
+      b->off = c->ur_outoff;
+      if (c->ur_out)
+	c->ur_outlast->next = b;
+      else
+	c->ur_out = b;
+      c->ur_outlast = b;
+      c->ur_nout++;
+    }
+    k = n - done < IOBLK_SIZE - b->len ? n - done : IOBLK_SIZE - b->len;
+    memcpy (b->buf + b->len, buf + done, k);
+    b->len += k;
+    c->ur_outoff += k;
+    c->ur_outbytes += k;
+    done += k;
+  }
+  if (!done && !c->ur_nout) {
+    /* The arena ran dry, so write directly. */
+    r = pwrite (c->wfd, buf, n, c->ur_outoff);
+    if (r > 0)
+      c->ur_outoff += r;
+    return r;
+  }
+  if (done)
+    conn_touch (c);
+  return done;
+}
+
+/* Submits c's staged output. */
+static void
+ur_flush (conn_t *c)
+{
+  struct ioblk *b;
+
+  for (b = c->ur_out; b; b = b->next)
+    if (!b->busy && b->done < b->len)
+      ur_queue (b);
+}
+
+static void
+ur_complete (struct ioblk *b, int res)
+{
+  conn_t *c = b->c;
+  struct ioblk **bp, *prev = NULL;
+
+  b->busy = 0;
+  if (!c) {
+    ur_putblk (b);
+    return;
+  }
+
+  if (!b->write) {
+    if (res < 0)
+      b->err = -res;
+    else if (res == 0)
+      b->eof = c->ur_eof = 1;
+    else if ((b->len += res) < IOBLK_SIZE) {
+      ur_queue (b);		/* a short read, or the end of the file */
+      return;
+    }
+    if (b == c->ur_in)
+      conn_touch (c);
+    return;
+  }
+
+  if (res < 0 && res != -EINTR && res != -EAGAIN) {
+    errno = -res;
+    perror ("write");
+    c->write_err = 1;
+  }
+  else if (res >= 0) {
+    b->done += res;
+    c->ur_outbytes -= res;
+  }
+  if (!c->write_err && b->done < b->len) {
+    ur_queue (b);
+    return;
+  }
+  for (bp = &c->ur_out; *bp != b; bp = &(*bp)->next)
+    prev = *bp;
+  *bp = b->next;
+  if (c->ur_outlast == b)
+    c->ur_outlast = prev;
+  c->ur_nout--;
+  ur_putblk (b);
+  if (c->write_eof && !c->write_err && !c->ur_outbytes) {
+    c->write_err = 1;
+    shutdown (c->wfd, SHUT_WR);
+  }
+  conn_touch (c);
+  if (!c->delete_me)
+    rel_output (c->rel);
+}
+
+static void
+ur_reap (void)
+{
+  unsigned head, tail;
+  struct io_uring_cqe *cqe;
+
+  if (ur.fd < 0)
+    return;
+  head = *ur.cqhead;
+  tail = __atomic_load_n (ur.cqtail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    cqe = &ur.cqes[head++ & ur.cqmask];
+    ur_complete ((struct ioblk *) (uintptr_t) cqe->user_data, cqe->res);
+    __atomic_store_n (ur.cqhead, head, __ATOMIC_RELEASE);
+    tail = __atomic_load_n (ur.cqtail, __ATOMIC_ACQUIRE);
+  }
+}
+
+/* Lets go of c's blocks, leaving those in flight to their completions. */
+static void
+ur_release (conn_t *c)
+{
+  struct ioblk *b, *nb;
+  int i;
+
+  for (i = 0; i < 2; i++)
+    for (b = i ? c->ur_out : c->ur_in; b; b = nb) {
+      nb = b->next;
+      if (b->busy)
+	b->c = NULL;
+      else
+	ur_putblk (b);
+    }
+  if (c->ur_rd)
+    ur_register (c->rfd, 0);
+  if (c->ur_wr)
+    ur_register (c->wfd, 0);
+}
+#endif /* URING */
+
+/* Sets up the event loop, watching mainfd if it is not -1. */
+static void
+ev_init (int fd)
+{
+  struct epoll_event ev;
+
+  if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+    perror ("epoll_create1");
+    exit (1);
+  }
+  /* Do catch errors on stderr, unless it is a file */
+  memset (&ev, 0, sizeof (ev));
+  ev.data.fd = 2;
+  epoll_ctl (epfd, EPOLL_CTL_ADD, 2, &ev);
+  mainfd = fd;
+  if (mainfd >= 0)
+    ev_watch (NULL, mainfd, &mainwatch, EPOLLIN);
+#if URING
+  ur_init ();
+#endif /* URING */
+}
+
+union gsoctl {
+  char buf[CMSG_SPACE (sizeof (uint16_t))];
+  struct cmsghdr align;
+};
+
+/* Lays out the queued packets from the from'th on as messages for
+ * sendmmsg, starting at msgs.  With GSO, a run of packets of one size,
+ * and a shorter packet that may end it, make up one message.  Returns
+ * the number of messages. */
+static int
+conn_txmsgs (conn_t *c, int from, struct mmsghdr *msgs, struct iovec *iov,
+	     union gsoctl *ctl)
+{
+  struct cmsghdr *cm;
+  int i, m;
+
+  for (i = from, m = 0; i < c->ntxq; m++) {
+    int start = i++;
+    if (c->gso) {
+      while (i < c->ntxq && i - start < GSO_SEGS_MAX
+	     && c->txlen[i] == c->txlen[start])
+	i++;
+      if (i < c->ntxq && i - start < GSO_SEGS_MAX
+	  && c->txlen[i] < c->txlen[start])
+	i++;
+    }
+    memset (&msgs[m], 0, sizeof (msgs[m]));
+    msgs[m].msg_hdr.msg_iov = &iov[start];
+    msgs[m].msg_hdr.msg_iovlen = i - start;
+    if (c->server) {
+      msgs[m].msg_hdr.msg_name = &c->peer;
+      msgs[m].msg_hdr.msg_namelen = addrsize (&c->peer);
+    }
+    if (i - start > 1) {
+      msgs[m].msg_hdr.msg_control = ctl[m].buf;
+      msgs[m].msg_hdr.msg_controllen = sizeof (ctl[m].buf);
+      cm = CMSG_FIRSTHDR (&msgs[m].msg_hdr);
+      cm->cmsg_level = SOL_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+      *(uint16_t *) CMSG_DATA (cm) = c->txlen[start];
+    }
+  }
+  return m;
+}
+
+/* Sends the queued packets with as few sendmmsg calls as the socket
+ * allows.  Whatever it will not take yet stays queued, and conn_poll
+ * watches the socket for EPOLLOUT to try again. */
+static void
+conn_flush (conn_t *c)
+{
+  struct mmsghdr msgs[TXBATCH_MAX];
+  struct iovec iov[TXBATCH_MAX];
+  union gsoctl ctl[TXBATCH_MAX];
+  int i, k, m, n, nmsgs, sent = 0;
+
+  if (!c->ntxq)
+    return;
+  for (i = 0; i < c->ntxq; i++) {
+    iov[i].iov_base = c->txq[i];
+    iov[i].iov_len = c->txlen[i];
+  }
+  nmsgs = conn_txmsgs (c, 0, msgs, iov, ctl);
+
+  for (m = 0; m < nmsgs; m += n) {
+    n = sendmmsg (c->nfd, msgs + m, nmsgs - m, 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	break;
+      /* The route cannot segment, say for want of checksum offload, so
+       * go back to one datagram per packet. */
+      if ((errno == EIO || errno == EINVAL)
+	  && msgs[m].msg_hdr.msg_controllen) {
+	c->gso = 0;
+	nmsgs = m + conn_txmsgs (c, sent, msgs + m, iov, ctl + m);
+	n = 0;
+	continue;
+      }
+      /* An error for this message, such as ICMP port unreachable from
+       * the peer.  Its packets are lost, as lone sends would have lost
+       * them. */
+      if (opt_debug)
+	print_pkt (c->txq[sent], "send", -1);
+      sent += msgs[m].msg_hdr.msg_iovlen;
+      n = 1;
+      continue;
+    }
+    for (i = m; i < m + n; i++)
+      for (k = 0; k < (int) msgs[i].msg_hdr.msg_iovlen; k++, sent++)
+	if (opt_debug)
+	  print_pkt (c->txq[sent], "send", c->txlen[sent]);
+  }
+
+  for (i = 0; i < sent; i++)
+    conn_pktfree (c, c->txq[i]);
+  c->ntxq -= sent;
+  memmove (c->txq, c->txq + sent, c->ntxq * sizeof (c->txq[0]));
+  memmove (c->txlen, c->txlen + sent, c->ntxq * sizeof (c->txlen[0]));
+}
+
 int
 conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 {
-  int n;
+  packet_t *copy;
+
   assert (!c->delete_me);
-  if (c->server)
-    n = sendto (c->nfd, pkt, len, 0,
-		(const struct sockaddr *) &c->peer, addrsize (&c->peer));
-  else
-    n = send (c->nfd, pkt, len, 0);
-  if (opt_debug)
-    print_pkt (pkt, "send", n);
-  return n;
+  if (c->ntxq == TXBATCH_MAX)
+    conn_flush (c);
+  if (c->ntxq == TXBATCH_MAX) {
+    errno = EAGAIN;
+    return -1;
+  }
+  copy = conn_pktalloc (c);
+  memcpy (copy, pkt, len);
+  c->txq[c->ntxq] = copy;
+  c->txlen[c->ntxq++] = len;
+  conn_touch (c);
+  return len;
+}
+
+packet_t *
+conn_pktalloc (conn_t *c)
+{
+  packet_t *pkt;
+  struct pktchunk *pc;
+  int i;
+
+  if (!c->pool_free) {
+    if (posix_memalign ((void **) &pc, 64, sizeof (*pc))) {
+      fprintf (stderr, "%s: out of memory allocating %d bytes\n",
+	       progname, (int) sizeof (*pc));
+      abort ();
+    }
+    pc->next = c->pool_chunks;
+    c->pool_chunks = pc;
+    c->pool_nchunks++;
+    for (i = PKTPOOL_CHUNK - 1; i >= 0; i--)
+      conn_pktfree (c, (packet_t *) (pc->slots + i * PKTPOOL_SLOT));
+  }
+
+  pkt = c->pool_free;
+  c->pool_free = *(packet_t **) pkt;
+  c->pool_nallocs++;
+  return pkt;
+}
+
+void
+conn_pktfree (conn_t *c, packet_t *pkt)
+{
+  *(packet_t **) pkt = c->pool_free;
+  c->pool_free = pkt;
 }
 
 size_t
@@ -141,7 +882,10 @@ conn_bufspace (conn_t *c)
   size_t used = 0;
   const size_t bufsize = 8192;
 
-
+#if URING
+  if (c->ur_wr)
+    return UR_WRITEBEHIND * IOBLK_SIZE - c->ur_outbytes;
+#endif /* URING */
   for (ch = c->outq; ch; ch = ch->next)
     used += (ch->size - ch->used);
   return used > bufsize ? 0 : bufsize - used;
@@ -157,6 +901,10 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
 
   if (n == 0) {
     c->write_eof = 1;
+#if URING
+    if (c->ur_outbytes)
+      return 0;			/* shut down by the last completion */
+#endif /* URING */
     if (!c->outq)
     {
       close(outfile);
@@ -175,6 +923,20 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
   if (!conn_bufspace (c))
     return 0;
 
+#if URING
+  if (c->ur_wr) {
+    int r = ur_output (c, buf, n);
+    if (r < 0) {
+      perror ("write");
+      c->write_err = 2;
+      return -1;
+    }
+    if (r > 0 && log_out >= 0)
+      write (log_out, buf, r);
+    return r;
+  }
+#endif /* URING */
+
   if (log_out >= 0)
     write (log_out, buf, n);
 
@@ -203,8 +965,8 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     c->outqtail = &ch->next;
   }
 
-  if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
+  if (c->outq)
+    conn_touch (c);
   return _n;
 }
 
@@ -216,12 +978,18 @@ conn_input (conn_t *c, void *buf, size_t n)
 
   if (c->read_eof)
     return -1;
+#if URING
+  if (c->ur_rd)
+    r = ur_input (c, buf, n);
+  else
+#endif /* URING */
   r = read (c->rfd, buf, n);
   if (r == 0 || (r < 0 && errno != EAGAIN)) {
     if (r == 0)
       errno = EIO;
     r = -1;
     c->read_eof = 1;
+    conn_touch (c);
     return r;
   }
   if (r < 0 && errno == EAGAIN)
@@ -231,7 +999,7 @@ conn_input (conn_t *c, void *buf, size_t n)
     write (log_in, buf, r);
 
   c->xoff = 0;
-  cevents[c->rpoll].events |= POLLIN;
+  conn_touch (c);
   if(r < 0)
     close(infile);
   return r;
@@ -249,11 +1017,31 @@ conn_alloc (void)
     conn_list->prev = &c->next;
   conn_list = c;
 
-  cevents_generation++;
+  c->rwatch = c->wwatch = c->nwatch = EV_UNWATCHED;
+  conn_touch (c);
 
   return c;
 }
 
+/* Turns on UDP segmentation offload for c, as far as the kernel
+ * supports it.  Server connections share one socket, which conn_demux
+ * reads without GRO. */
+static void
+conn_offload (conn_t *c)
+{
+  int val = 1;
+  socklen_t len = sizeof (val);
+
+  c->gso = getsockopt (c->nfd, SOL_UDP, UDP_SEGMENT, &val, &len) == 0;
+  val = 1;
+  c->gro = !c->server
+    && setsockopt (c->nfd, SOL_UDP, UDP_GRO, &val, sizeof (val)) == 0;
+  if (opt_debug)
+    fprintf (stderr, "%5d UDP GSO %s, GRO %s\n", getpid (),
+	     c->gso ? "on" : "unsupported",
+	     c->server ? "off" : c->gro ? "on" : "unsupported");
+}
+
 conn_t *
 conn_create (rel_t *rel, const struct sockaddr_storage *ss)
 {
@@ -284,6 +1072,8 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
   c->nfd = serverconf->udp_socket;
   c->rfd = c->wfd = n;
   c->server = 1;
+  if (serverconf->c.gso)
+    conn_offload (c);
 
   return c;
 }
@@ -292,24 +1082,37 @@ static void
 conn_free (conn_t *c)
 {
   chunk_t *ch, *nch;
+  struct pktchunk *pc, *npc;
 
   for (ch = c->outq; ch; ch = nch) {
     nch = ch->next;
     free (ch);
   }
+  for (pc = c->pool_chunks; pc; pc = npc) {
+    npc = pc->next;
+    free (pc);
+  }
 
   if (c->next)
     c->next->prev = c->prev;
   *c->prev = c->next;
 
+#if URING
+  ur_release (c);
+#endif /* URING */
+  ev_watch (c, c->rfd, &c->rwatch, EV_UNWATCHED);
+  if (c->wfd != c->rfd)
+    ev_watch (c, c->wfd, &c->wwatch, EV_UNWATCHED);
+  if (!c->server)
+    ev_watch (c, c->nfd, &c->nwatch, EV_UNWATCHED);
   close (c->rfd);
   if (c->wfd != c->rfd)
     close (c->wfd);
   if (!c->server)
     close (c->nfd);
+  conn_set_timer (c, NULL);
   close(infile);
   close(outfile);
-  cevents_generation++;
 
   /* to help catch errors */
   memset (c, 0xc5, sizeof (*c));
@@ -320,6 +1123,8 @@ void
 conn_destroy (conn_t *c)
 {
   c->delete_me = 1;
+  conn_set_timer (c, NULL);
+  conn_touch (c);
 }
 
 void
@@ -328,9 +1133,7 @@ conn_drain (conn_t *c)
   chunk_t *ch;
   int didsome = 0;
 
-  if (c->wpoll)
-    cevents[c->wpoll].events &= ~POLLOUT;
-
+  conn_touch (c);
   if (c->write_err)
     return;
 
@@ -344,11 +1147,8 @@ conn_drain (conn_t *c)
     }
     didsome = 1;
     ch->used += n;
-    if (ch->used < ch->size) {
-      if (c->wpoll)
-	cevents[c->wpoll].events |= POLLOUT;
+    if (ch->used < ch->size)
       break;
-    }
     c->outq = ch->next;
     if (!c->outq)
       c->outqtail = &c->outq;
@@ -363,195 +1163,400 @@ conn_drain (conn_t *c)
 }
 
 static void
-conn_mkevents (void)
+conn_demux (const struct config_server *cs)
 {
-  struct pollfd *e;
-  conn_t **r, **w;
-  size_t n = 2;
-  conn_t *c;
+  static packet_t pkts[RXBATCH_MAX];
+  struct sockaddr_storage ss[RXBATCH_MAX];
+  struct mmsghdr msgs[RXBATCH_MAX];
+  struct iovec iov[RXBATCH_MAX];
+  int i, n;
+
+  for (i = 0; i < RXBATCH_MAX; i++) {
+    iov[i].iov_base = &pkts[i];
+    iov[i].iov_len = sizeof (pkts[i]);
+  }
+  for (;;) {
+    memset (msgs, 0, sizeof (msgs));
+    for (i = 0; i < RXBATCH_MAX; i++) {
+      msgs[i].msg_hdr.msg_name = &ss[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof (ss[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    memset (ss, 0, sizeof (ss));
+    n = recvmmsg (cs->udp_socket, msgs, RXBATCH_MAX, 0, NULL);
+    if (n < 0)
+      break;
+    for (i = 0; i < n; i++) {
+      if (opt_debug)
+	print_pkt (&pkts[i], "recv", msgs[i].msg_len);
+      rel_demux (&cs->c, &ss[i], &pkts[i], msgs[i].msg_len);
+      memset (&pkts[i], 0xc7, msgs[i].msg_len);	/* to help debugging */
+      memset (&ss[i], 0x7c, sizeof (ss[i]));	/* to help debugging */
+    }
+  }
+  if (errno != EAGAIN)
+    perror ("UDP recv");
+}
 
-  for (c = conn_list; c; c = c->next) {
-    if (c->read_eof) {
-      c->rpoll = 0;
-      if (c->write_err)
-	c->wpoll = 0;
-      else
-	c->wpoll = n++;
+/* Copies len bytes from offset off into the buffers of iov. */
+static void
+iov_gather (const struct iovec *iov, size_t off, void *dst, size_t len)
+{
+  size_t k;
+
+  for (; off >= iov->iov_len; iov++)
+    off -= iov->iov_len;
+  for (; len; iov++, off = 0) {
+    k = iov->iov_len - off < len ? iov->iov_len - off : len;
+    memcpy (dst, (char *) iov->iov_base + off, k);
+    dst = (char *) dst + k;
+    len -= k;
+  }
+}
+
+/* Like conn_recv, but for a socket with UDP_GRO on, where one datagram
+ * may be a burst of segments glued together.  The pool packets it reads
+ * into are cut to the segment size the last burst had, so that each
+ * segment of the next lands in a packet of its own; segments that do
+ * not, or that spill past them, are copied out. */
+static void
+conn_recvgro (conn_t *c)
+{
+  static char spill[65536];
+  struct iovec iov[RXBATCH_MAX + 1];
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } ctl;
+  struct msghdr mh;
+  struct cmsghdr *cm;
+  size_t seg, slot, off, len;
+  packet_t *pkt;
+  ssize_t n;
+  int i;
+
+  slot = c->gro_seg ? c->gro_seg : sizeof (packet_t);
+  for (i = 0; i < RXBATCH_MAX; i++) {
+    if (!c->rxq[i])
+      c->rxq[i] = conn_pktalloc (c);
+    iov[i].iov_base = c->rxq[i];
+    iov[i].iov_len = slot;
+  }
+  iov[i].iov_base = spill;
+  iov[i].iov_len = sizeof (spill);
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = RXBATCH_MAX + 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof (ctl.buf);
+  n = recvmsg (c->nfd, &mh, 0);
+  if (n < 0) {
+    if (opt_debug)
+      print_pkt (NULL, "recv", n);
+    if (errno != EAGAIN)
+      perror ("recv");
+    return;
+  }
+
+  seg = n;
+  for (cm = CMSG_FIRSTHDR (&mh); cm; cm = CMSG_NXTHDR (&mh, cm))
+    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+      seg = *(int *) CMSG_DATA (cm);
+  if (seg < (size_t) n && seg <= sizeof (packet_t))
+    c->gro_seg = seg;
+
+  for (off = 0; off < (size_t) n; off += seg) {
+    len = (size_t) n - off < seg ? (size_t) n - off : seg;
+    if (off % slot == 0 && off / slot < RXBATCH_MAX && len <= slot) {
+      pkt = c->rxq[off / slot];
+      c->rxq[off / slot] = NULL;
     }
     else {
-      c->rpoll = n++;
-      if (c->write_err)
-	c->wpoll = 0;
-      else if (c->wfd == c->rfd)
-	c->wpoll = c->rpoll;
-      else
-	c->wpoll = n++;
-      if (c->server)
-	c->npoll = 0;
-      else
-	c->npoll = n++;
+      if (len > sizeof (packet_t))
+	len = sizeof (packet_t);
+      pkt = conn_pktalloc (c);
+      iov_gather (iov, off, pkt, len);
     }
+    if (opt_debug)
+      print_pkt (pkt, "recv", len);
+    if (c->delete_me)
+      conn_pktfree (c, pkt);
+    else
+      rel_recvpkt (c->rel, pkt, len);
   }
-
-  e = xmalloc (n * sizeof (*e));
-  memset (e, 0, n * sizeof (*e));
-  if (cevents)
-    e[0] = cevents[0];
-  else
-    e[0].fd = -1;
-  e[1].fd = 2;			/* Do catch errors on stderr */
-    
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll) {
-      e[c->rpoll].fd = c->rfd;
-      if (!c->xoff)
-	e[c->rpoll].events |= POLLIN;
-    }
-    if (c->wpoll) {
-      e[c->wpoll].fd = c->wfd;
-      if (c->outq)
-	e[c->wpoll].events |= POLLOUT;
-    }
-    if (c->npoll) {
-      e[c->npoll].fd = c->nfd;
-      e[c->npoll].events |= POLLIN;
-    }
-  }
-
-  r = xmalloc (n * sizeof (*r));
-  memset (r, 0, n * sizeof (*r));
-  w = xmalloc (n * sizeof (*w));
-  memset (w, 0, n * sizeof (*w));
-  for (c = conn_list; c; c = c->next) {
-    if (c->rpoll > 0)
-      r[c->rpoll] = c;
-    if (c->npoll > 0)
-      r[c->npoll] = c;
-    if (c->wpoll > 0)
-      w[c->wpoll] = c;
-  }
-
-  free (cevents);
-  cevents = e;
-  ncevents = n;
-  free (evreaders);
-  evreaders = r;
-  free (evwriters);
-  evwriters = w;
 }
 
+/* Take what has arrived on a client connection's socket with one
+ * recvmmsg, straight into packets from its pool, and hand each one over
+ * to rel_recvpkt, so that the packets they prompt go out together. */
 static void
-conn_demux (const struct config_server *cs)
+conn_recv (conn_t *c)
 {
-  packet_t pkt;
-  struct sockaddr_storage ss;
-  int n;
+  struct mmsghdr msgs[RXBATCH_MAX];
+  struct iovec iov[RXBATCH_MAX];
+  packet_t *pkt;
+  int i, n;
 
-  memset (&ss, 0, sizeof (ss));
-  while ((n = debug_recv (cs->udp_socket, &pkt, sizeof (pkt), 0, &ss)) >= 0) {
-    rel_demux (&cs->c, &ss, &pkt, n);
-    memset (&pkt, 0xc7, n);	     /* to help debugging */
-    memset (&ss, 0x7c, sizeof (ss)); /* to help debugging */
+  if (c->gro) {
+    conn_recvgro (c);
+    return;
+  }
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < RXBATCH_MAX; i++) {
+    if (!c->rxq[i])
+      c->rxq[i] = conn_pktalloc (c);
+    iov[i].iov_base = c->rxq[i];
+    iov[i].iov_len = sizeof (packet_t);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg (c->nfd, msgs, RXBATCH_MAX, 0, NULL);
+  if (n < 0) {
+    if (opt_debug)
+      print_pkt (NULL, "recv", n);
+    if (errno != EAGAIN)
+      perror ("recv");
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    pkt = c->rxq[i];
+    c->rxq[i] = NULL;
+    if (opt_debug)
+      print_pkt (pkt, "recv", msgs[i].msg_len);
+    if (c->delete_me)
+      conn_pktfree (c, pkt);
+    else
+      rel_recvpkt (c->rel, pkt, msgs[i].msg_len);
   }
-  if (errno != EAGAIN)
-    perror ("UDP recv");
 }
 
-long
-need_timer_in (const struct timespec *last, long timer)
+static int
+timespec_before (const struct timespec *a, const struct timespec *b)
 {
-  long to;
-  struct timespec ts;
+  return a->tv_sec < b->tv_sec
+    || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
 
-  clock_gettime (CLOCK_MONOTONIC, &ts);
-  to = ts.tv_sec - last->tv_sec;
-  if (to > timer / 1000)
-    return 0;
-  to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-  if (to >= timer)
-    return 0;
-  return
-    timer - to;
+static void
+timerq_place (conn_t *c, int i)
+{
+  timerq[i] = c;
+  c->timer_idx = i;
 }
 
-void
-conn_poll (const struct config_common *cc)
+/* Restore the heap property for the entry at position i */
+static void
+timerq_fix (int i)
 {
-  int i;
-  conn_t *c, *nc;
-  static int last_cg;
+  conn_t *c = timerq[i];
+  int child;
 
-  if (last_cg != cevents_generation) {
-    conn_mkevents ();
-    cevents_generation = last_cg;
+  while (i > 1 && timespec_before (&c->timer_at, &timerq[i / 2]->timer_at)) {
+    timerq_place (timerq[i / 2], i);
+    i /= 2;
   }
+  while ((child = 2 * i) <= ntimerq) {
+    if (child < ntimerq
+	&& timespec_before (&timerq[child + 1]->timer_at,
+			    &timerq[child]->timer_at))
+      child++;
+    if (!timespec_before (&timerq[child]->timer_at, &c->timer_at))
+      break;
+    timerq_place (timerq[child], i);
+    i = child;
+  }
+  timerq_place (c, i);
+}
 
-  if (cevents[0].fd >= 0)
-    poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
-  else
-    poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-
-  for (i = 1; i < ncevents; i++) {
-    if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-      if ((c = evreaders[i]) && !c->delete_me) {
-	if (cevents[i].fd == c->rfd) {
-	  c->xoff = 1;
-	  cevents[i].events &= ~POLLIN;
-	  rel_read (c->rel);
-	}
-	else if (cevents[i].fd == c->nfd
-		 && (cevents[i].revents & (POLLERR|POLLHUP))) {
-	  char addr[NI_MAXHOST] = "unknown";
-	  char port[NI_MAXSERV] = "unknown";
-	  getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-		       addr, sizeof (addr), port, sizeof (port),
-		       NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-	  fprintf (stderr, "[received ICMP port unreachable;"
-		   " assuming peer at %s:%s is dead]\n", addr, port);
-	  if (cc->single_connection)
-	    exit (1);
-	  rel_destroy (c->rel);
-	}
-	else if (cevents[i].fd == c->nfd && !c->server) {
-	  packet_t pkt;
-	  int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-	  if (len < 0) {
-	    if (errno != EAGAIN)
-	      perror ("recv");
-	  }
-	  else {
-	    rel_recvpkt (c->rel, &pkt, len);
-	    memset (&pkt, 0xc9, len); /* for debugging */
-	  }
-	}
+void
+conn_set_timer (conn_t *c, const struct timespec *when)
+{
+  int i = c->timer_idx;
+
+  if (!when) {
+    if (!i)
+      return;
+    c->timer_idx = 0;
+    if (i != ntimerq--) {
+      timerq[i] = timerq[ntimerq + 1];
+      timerq_fix (i);
+    }
+    return;
+  }
+
+  c->timer_at = *when;
+  if (!i) {
+    if (ntimerq + 1 >= timerq_size) {
+      timerq_size = timerq_size ? 2 * timerq_size : 16;
+      timerq = realloc (timerq, timerq_size * sizeof (*timerq));
+      if (!timerq) {
+	fprintf (stderr, "%s: out of memory\n", progname);
+	abort ();
       }
     }
-    if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-	&& evwriters[i])
-      conn_drain (evwriters[i]);
-    if (cevents[i].revents & (POLLHUP|POLLERR)) {
+    i = ++ntimerq;
+  }
+  timerq_place (c, i);
+  timerq_fix (i);
+}
+
+/* Handles what epoll reported for fd, watched by c. */
+static void
+conn_event (conn_t *c, int fd, uint32_t events,
+	    const struct config_common *cc)
+{
+  if ((events & (EPOLLIN|EPOLLERR|EPOLLHUP)) && !c->delete_me) {
+    if (fd == c->rfd) {
+      c->xoff = 1;
+      conn_touch (c);
+      rel_read (c->rel);
+    }
+    else if (fd == c->nfd && (events & (EPOLLERR|EPOLLHUP))) {
+      char addr[NI_MAXHOST] = "unknown";
+      char port[NI_MAXSERV] = "unknown";
+      getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+		   addr, sizeof (addr), port, sizeof (port),
+		   NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+      fprintf (stderr, "[received ICMP port unreachable;"
+	       " assuming peer at %s:%s is dead]\n", addr, port);
+      if (cc->single_connection)
+	exit (1);
+      rel_destroy (c->rel);
+    }
+    else if (fd == c->nfd && !c->server)
+      conn_recv (c);
+  }
+  if ((events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) && fd == c->wfd)
+    conn_drain (c);
+  if ((events & EPOLLOUT) && fd == c->nfd)
+    conn_touch (c);
+  if (events & (EPOLLHUP|EPOLLERR)) {
 #if 0
-      fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
-	       getpid (), cevents[i].fd, cevents[i].revents);
+    fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
+	     getpid (), fd, events);
 #endif
+    if (fd == c->rfd)
+      ev_watch (c, fd, &c->rwatch, EV_DEAD);
+    else if (fd == c->wfd)
+      ev_watch (c, fd, &c->wwatch, EV_DEAD);
+    else if (fd == c->nfd)
+      ev_watch (c, fd, &c->nwatch, EV_DEAD);
+  }
+}
+
+void
+conn_poll (const struct config_common *cc)
+{
+  static struct epoll_event evs[EVBATCH_MAX];
+  static int have_pwait2 = 1;
+  int i, n, fileready = 0, mainout = 0, freed = 0;
+  conn_t *c, *nc;
+  struct timespec now, wait, *waitp = NULL;
+
+  /* Send what the last pass queued and bring the watches of the
+   * connections that changed up to date.  One whose socket could not
+   * take all its packets gets watched for EPOLLOUT, or stays dirty when
+   * it shares the server's socket.  A deleted connection stays dirty
+   * until its output and its last packets are out, and then goes,
+   * without a sleep, so that the caller sees it gone. */
+  for (c = conn_dirty, conn_dirty = NULL; c; c = nc) {
+    nc = c->dirty_next;
+    c->dirty = 0;
+    conn_flush (c);
+    if (c->delete_me && (c->write_err || !conn_outpending (c)) && !c->ntxq) {
+      conn_free (c);
+      freed = 1;
+      continue;
+    }
+    if (c->delete_me || (c->server && c->ntxq))
+      conn_touch (c);
+    if (c->server && c->ntxq)
+      mainout = 1;
+    conn_watch (c);
+  }
+  if (mainfd >= 0)
+    ev_watch (NULL, mainfd, &mainwatch, EPOLLIN | (mainout ? EPOLLOUT : 0));
+#if URING
+  ur_submit ();
+#endif /* URING */
+  mainready = 0;
+  if (freed)
+    return;
+
+  /* Regular files are always ready for what they are watched for.  Only
+   * stand-alone mode has them, with its one connection. */
+  if (nfiles)
+    for (c = conn_list; c; c = c->next)
+      if ((c->rwatch >= 0 && (c->rwatch & EV_FILE) && (c->rwatch & EPOLLIN))
+	  || (c->wwatch >= 0 && (c->wwatch & EV_FILE)
+	      && (c->wwatch & EPOLLOUT)))
+	fileready = 1;
+
+  /* Sleep until the earliest timer deadline, or indefinitely if no
+   * timer is armed. */
+  if (ntimerq) {
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    wait.tv_sec = timerq[1]->timer_at.tv_sec - now.tv_sec;
+    wait.tv_nsec = timerq[1]->timer_at.tv_nsec - now.tv_nsec;
+    if (wait.tv_nsec < 0) {
+      wait.tv_sec--;
+      wait.tv_nsec += 1000000000;
+    }
+    if (wait.tv_sec < 0)
+      wait.tv_sec = wait.tv_nsec = 0;
+    waitp = &wait;
+  }
+  if (fileready) {
+    wait.tv_sec = wait.tv_nsec = 0;
+    waitp = &wait;
+  }
+
+  /* Kernels before 5.11 lack epoll_pwait2, and sleep to the millisecond,
+   * rounded up. */
+  n = -1;
+  if (have_pwait2) {
+    n = epoll_pwait2 (epfd, evs, EVBATCH_MAX, waitp, NULL);
+    if (n < 0 && errno == ENOSYS)
+      have_pwait2 = 0;
+  }
+  if (!have_pwait2)
+    n = epoll_wait (epfd, evs, EVBATCH_MAX,
+		    !waitp ? -1 : waitp->tv_sec * 1000
+		    + (waitp->tv_nsec + 999999) / 1000000);
+
+#if URING
+  ur_reap ();
+#endif /* URING */
+  for (i = 0; i < n; i++) {
+    int fd = evs[i].data.fd;
+    if (fd == mainfd)
+      mainready = (evs[i].events & ~EPOLLOUT) != 0;
+    else if (fd == 2) {
       /* If stderr has an error, the tester has probably died, so exit
        * immediately. */
-      if (cevents[i].fd == 2)
+      if (evs[i].events & (EPOLLHUP|EPOLLERR))
 	exit (1);
-      cevents[i].fd = -1;
     }
-    cevents[i].revents = 0;
-  }
-
-  if (need_timer_in (&last_timeout, cc->timer) == 0) {
-    rel_timer ();
-    clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+    else if (fd < nevconns && (c = evconns[fd]))
+      conn_event (c, fd, evs[i].events, cc);
   }
+  if (fileready)
+    for (c = conn_list; c; c = c->next) {
+      if (c->rwatch >= 0 && (c->rwatch & EV_FILE) && (c->rwatch & EPOLLIN))
+	conn_event (c, c->rfd, EPOLLIN, cc);
+      if (c->wwatch >= 0 && (c->wwatch & EV_FILE) && (c->wwatch & EPOLLOUT))
+	conn_event (c, c->wfd, EPOLLOUT, cc);
+    }
 
-  for (c = conn_list; c; c = nc) {
-    nc = c->next;
-    if (c->delete_me && (c->write_err || !c->outq))
-      conn_free (c);
+  /* Fire expired timers.  rel_timer may re-arm, but only for a time
+   * after now, so this only visits connections that are due. */
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  while (ntimerq && !timespec_before (&now, &timerq[1]->timer_at)) {
+    c = timerq[1];
+    conn_set_timer (c, NULL);
+    if (!c->delete_me)
+      rel_timer (c->rel);
   }
 }
 
@@ -802,32 +1807,14 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
   return s;
 }
 
-static int
-debug_recv (int s, packet_t *buf, size_t len, int flags,
-	    struct sockaddr_storage *from)
-{
-  socklen_t socklen = sizeof (*from);
-  int n;
-  if (from)
-    n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
-  else
-    n = recv (s, buf, len, flags);
-  if (opt_debug)
-    print_pkt (buf, "recv", n);
-  return n;
-}
-
-
 void
 do_client (struct config_client *cc)
 {
-  conn_mkevents ();
   make_async (cc->listen_socket);
-  cevents[0].fd = cc->listen_socket;
-  cevents[0].events = POLLIN;
+  ev_init (cc->listen_socket);
   for (;;) {
     conn_poll (&cc->c);
-    if (cevents[0].revents) {
+    if (mainready) {
       struct sockaddr_storage ss;
       socklen_t len = sizeof (ss);
       int s, u;
@@ -845,8 +1832,11 @@ do_client (struct config_client *cc)
 	c->wfd = s;
 	c->nfd = u;
 	c->peer = cc->server;
+	if (cc->c.gso)
+	  conn_offload (c);
 	c->rel = rel_create (c, NULL, &cc->c);
-	conn_mkevents ();
+	if (!c->rel)
+	  conn_destroy (c);
       }
       else
 	close (s);
@@ -858,13 +1848,11 @@ void
 do_server (struct config_server *cs)
 {
   serverconf = cs;
-  conn_mkevents ();
   make_async (cs->udp_socket);
-  cevents[0].fd = cs->udp_socket;
-  cevents[0].events = POLLIN;
+  ev_init (cs->udp_socket);
   for (;;) {
     conn_poll (&cs->c);
-    if (cevents[0].revents)
+    if (mainready)
       conn_demux (cs);
   }
 }
@@ -876,6 +1864,13 @@ usage (void)
 	   "usage: %s -s inputfile udp-port [relayer:]udp-port\n"
            "       %s -r outputfile udp-port [relayer:]udp-port\n"
            "       -w: RECEIVER's maximum receiving window size, in number of packets\n"
+           "       -b: SENDER's send buffer size, in number of packets\n"
+           "       -t: initial retransmission timeout, in milliseconds\n"
+           "       -m, -M: minimum and maximum retransmission timeout, in milliseconds\n"
+           "       -c, --cc: congestion control algorithm, reno, cubic, bbr or ledbat (default reno)\n"
+           "       -p, --pace: pace reno, cubic and ledbat at cwnd per RTT too\n"
+           "       -P, --pace-burst: most packets pacing sends back to back (default 1)\n"
+           "       -g, --gso: send and receive bursts of packets with UDP GSO and GRO\n"
 	   ,progname, progname);
   exit (1);
 }
@@ -888,6 +1883,14 @@ main (int argc, char **argv)
     { "window", required_argument, NULL, 'w' },
     { "sender", required_argument, NULL, 's'},
     { "receiver", required_argument, NULL, 'r'},
+    { "sndbuf", required_argument, NULL, 'b'},
+    { "timeout", required_argument, NULL, 't'},
+    { "rto-min", required_argument, NULL, 'm'},
+    { "rto-max", required_argument, NULL, 'M'},
+    { "cc", required_argument, NULL, 'c'},
+    { "pace", no_argument, NULL, 'p'},
+    { "pace-burst", required_argument, NULL, 'P'},
+    { "gso", no_argument, NULL, 'g'},
     { NULL, 0, NULL, 0 }
   };
   int opt;
@@ -904,7 +1907,13 @@ main (int argc, char **argv)
   sigaction (SIGPIPE, &sa, NULL);
 
   memset (&c, 0, sizeof (c));
-  c.window = 1;
+  c.window = 25;
+  c.sndbuf = 4096;
+  c.timeout = 100;
+  c.rto_min = 20;
+  c.rto_max = 60000;
+  c.cc = "reno";
+  c.pace_burst = 1;
   c.sender_receiver = RECEIVER; /* default, it is receiver*/
 
   progname = strrchr (argv[0], '/');
@@ -914,7 +1923,7 @@ main (int argc, char **argv)
     progname = argv[0];
 
 
-  while ((opt = getopt_long (argc, argv, "ds:r:w:", o, NULL)) != -1)
+  while ((opt = getopt_long (argc, argv, "ds:r:w:b:t:m:M:c:pP:g", o, NULL)) != -1)
     switch (opt) {
     case 'd':
       opt_debug = 1;
@@ -930,16 +1939,41 @@ main (int argc, char **argv)
     case 'w': //receiver's largest receiving window size, the sender does not need this parameter.
       c.window = atoi (optarg);
       break;
+    case 'b': //sender's send buffer; input is not read further ahead of the acks than this
+      c.sndbuf = atoi (optarg);
+      break;
+    case 't':
+      c.timeout = atoi (optarg);
+      break;
+    case 'm':
+      c.rto_min = atoi (optarg);
+      break;
+    case 'M':
+      c.rto_max = atoi (optarg);
+      break;
+    case 'c':
+      c.cc = optarg;
+      break;
+    case 'p':
+      c.pace = 1;
+      break;
+    case 'P':
+      c.pace_burst = atoi (optarg);
+      break;
+    case 'g':
+      c.gso = 1;
+      break;
     default:
       usage ();
       break;
     }
 
 
-  if(optind + 2 != argc || c.window < 1)
+  if(optind + 2 != argc || c.window < 1 || c.sndbuf < 1
+     || c.timeout < 1 || c.rto_min < 1 || c.rto_max < c.rto_min
+     || c.pace_burst < 1)
     usage ();
 
-  c.timer = 10; //wake up rel_timer every 10ms
   local = argv[optind];
   remote = argv[optind+1];
 
@@ -987,9 +2021,13 @@ main (int argc, char **argv)
   make_async (cn->rfd);
   make_async (cn->wfd);
   make_async (cn->nfd);
+  if (c.gso)
+    conn_offload (cn);
   cn->rel = rel_create (cn, NULL, &c);
+  if (!cn->rel)
+    exit (1);
 
-  conn_mkevents ();
+  ev_init (-1);
   while (conn_list)
     conn_poll (&c);
   return 0;
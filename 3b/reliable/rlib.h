@@ -55,7 +55,12 @@
             packets.  That means that once a packet is transmitted, it
             cannot be merged with another packet for retransmission.
 
-   - data:  Contains (len - 12) bytes of payload data for the
+   - tsval: The sender's clock, in microseconds, when the packet was
+            last transmitted.  The receiver reports how long it took
+            to arrive in its acks (see below), for delay-based
+            congestion control.
+
+   - data:  Contains (len - 20) bytes of payload data for the
             application.
 
    To conserve packets, a sender should not send more than one
@@ -65,12 +70,22 @@
  */
 
 
-/* Ack-only packets are only 12 bytes */
+/* Ack-only packets are 16 bytes, or 19 when they carry selective
+   acks: bit i of sack (sack[i / 8] >> (i % 8) & 1) says packet
+   ackno + 1 + i has been received.  delay is the one-way delay of
+   the last data packet received, the receiver's clock minus its
+   tsval in microseconds (so offset by the difference between the
+   two clocks), or 0 before there is one.  Anything shorter than a
+   data packet header is an ack, so sizeof (struct ack_packet), which
+   includes padding, is not the size on the wire. */
+#define SACK_BITS 24
 struct ack_packet {
   uint16_t cksum;
   uint16_t len;
   uint32_t ackno;
   uint32_t rwnd;
+  uint32_t delay;
+  uint8_t sack[SACK_BITS / 8];
 };
 
 struct packet {
@@ -79,6 +94,7 @@ struct packet {
   uint32_t ackno;
   uint32_t rwnd;
   uint32_t seqno;		/* Only valid if length > 8 */
+  uint32_t tsval;
   char data[1000];
 };
 typedef struct packet packet_t;
@@ -105,12 +121,36 @@ typedef struct packet packet_t;
                   be 1 for stop-and-wait).
 
        - timeout: Tells you what your retransmission timer should be,
-                  in milliseconds.  If after this many milliseconds a
-                  packet you sent has still not been acknowledged, you
-                  must retransmit the packet.  You may find the
-                  function clock_gettime with parameter
-                  CLOCK_MONOTONIC useful for keeping track of when
-                  packets are sent.  Run "man clock_gettime".
+                  in milliseconds, before you have measured the RTT.
+                  If after this many milliseconds a packet you sent
+                  has still not been acknowledged, you must retransmit
+                  the packet.  You may find the function clock_gettime
+                  with parameter CLOCK_MONOTONIC useful for keeping
+                  track of when packets are sent.  Run "man
+                  clock_gettime".
+
+       - rto_min, rto_max: Bounds on the retransmission timeout once
+                  it adapts to the measured RTT, in milliseconds.
+                  rto_min is the least margin kept above the smoothed
+                  RTT.
+
+       - cc: The name of the congestion control algorithm to use,
+                  "reno", "cubic", "bbr" or "ledbat".  rel_create fails
+                  if it does not know the algorithm.
+
+       - pace: If set, algorithms that only keep a window (reno,
+                  cubic, ledbat) also space their packets out in
+                  time, at cwnd per smoothed RTT.  bbr always paces.
+
+       - pace_burst: The most packets pacing sends back to back, as
+                  when catching up after a late wakeup.  Pacing may
+                  always catch up on a millisecond's worth.
+
+       - gso: Handled by the library.  It sends with UDP segmentation
+                  offload and receives with UDP_GRO where the kernel
+                  supports them, and sends and receives plain
+                  datagrams otherwise.  Receiving this way pays off
+                  when the peer sends with GSO as well.
 
    * Your task is to implement the following seven functions:
 
@@ -174,21 +214,29 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * Each connection has one timer.  Arm it with conn_set_timer for
+     the CLOCK_MONOTONIC time at which you next need to act (e.g., the
+     retransmission deadline of the oldest unacknowledged packet), and
+     the library calls rel_timer for that connection once the deadline
+     has passed.  A timer fires once; re-arm it from rel_timer if
+     needed.  The library sleeps until the earliest armed deadline,
+     so a connection with no timer armed causes no wakeups at all.
 
 */
 
 struct config_common {
   int window;			/* # of unacknowledged packets in flight */
-  int timer;			/* How often rel_timer called in milliseconds */
-  int timeout;			/* Retransmission timeout in milliseconds */
+  int timeout;			/* Retransmission timeout in milliseconds,
+				   until the RTT has been measured */
+  int rto_min;			/* Bounds on the adaptive retransmission */
+  int rto_max;			/*   timeout, in milliseconds */
   int single_connection;        /* Exit after first connection failure */
   int sender_receiver;          /* sender or receiver*/
+  int sndbuf;			/* # of packets the sender may buffer */
+  const char *cc;		/* Congestion control algorithm name */
+  int pace;			/* Pace window algorithms at cwnd/srtt */
+  int pace_burst;		/* # of packets pacing sends back to back */
+  int gso;			/* Batch datagrams with UDP GSO and GRO */
 };
 
 typedef struct reliable_state rel_t;
@@ -230,13 +278,44 @@ struct chunk {
 };
 typedef struct chunk chunk_t;
 
+/* Packet buffers are carved out of cache-aligned chunks of
+ * PKTPOOL_CHUNK slots and recycled through a per-connection free
+ * list, so once a connection has seen its largest window it no longer
+ * calls malloc per packet. */
+#define PKTPOOL_CHUNK 64
+#define PKTPOOL_SLOT ((sizeof (packet_t) + 63) & ~(size_t) 63)
+
+struct pktchunk {
+  struct pktchunk *next;
+  char pad[64 - sizeof (struct pktchunk *)];
+  char slots[PKTPOOL_CHUNK * PKTPOOL_SLOT];
+};
+
+
+/* conn_sendpkt queues copies of outgoing packets, and each pass of the
+ * event loop sends them together with one sendmmsg.  The queue is also
+ * sent as soon as it fills. */
+#define TXBATCH_MAX 64
+
+/* A client connection receives with recvmmsg, up to RXBATCH_MAX
+ * datagrams at a time, directly into packets from its pool. */
+#define RXBATCH_MAX 64
+
+/* With UDP segmentation offload, runs of equal-sized packets in the
+ * send queue go to the kernel as one datagram it cuts up again, and a
+ * client receives bursts the kernel has glued back together, which
+ * conn_recv splits into packets.  The kernel handles at most
+ * GSO_SEGS_MAX segments at a time. */
+#define GSO_SEGS_MAX 64
 
 struct conn {
   rel_t *rel;			/* Data from reliable */
 
-  int rpoll;			/* offsets into cevents array */
-  int wpoll;
-  int npoll;
+  int rwatch;			/* what epoll watches rfd, wfd and nfd for */
+  int wwatch;
+  int nwatch;
+  char dirty;			/* on the dirty list, linked through */
+  struct conn *dirty_next;	/*   dirty_next */
 
   int rfd;			/* input file descriptor */
   int wfd;			/* output file descriptor */
@@ -253,6 +332,43 @@ struct conn {
   chunk_t *outq;		/* chunks not yet written */
   chunk_t **outqtail;
 
+  struct timespec timer_at;	/* deadline set by conn_set_timer */
+  int timer_idx;		/* position in the timer heap, 0 if unarmed */
+
+  struct pktchunk *pool_chunks;	/* memory backing the packet pool */
+  packet_t *pool_free;		/* free packet slots, linked through
+				   their first bytes */
+  unsigned long pool_nchunks;	/* chunks malloced so far */
+  unsigned long pool_nallocs;	/* packets handed out so far */
+
+  packet_t *txq[TXBATCH_MAX];	/* packets queued to send, from the pool */
+  size_t txlen[TXBATCH_MAX];
+  int ntxq;
+
+  packet_t *rxq[RXBATCH_MAX];	/* pool packets the next recvmmsg fills */
+
+  char gso;			/* non-zero to send with UDP_SEGMENT */
+  char gro;			/* non-zero if the socket has UDP_GRO on */
+  size_t gro_seg;		/* segment size of the last glued burst */
+
+#if URING
+  /* Regular files are read ahead and written behind with io_uring, in
+   * blocks of a registered arena, at explicit offsets. */
+  char ur_probed;		/* rfd and wfd checked for io_uring */
+  char ur_rd;			/* rfd is read with io_uring */
+  char ur_wr;			/* wfd is written with io_uring */
+  char ur_eof;			/* a read has hit the end of rfd */
+  struct ioblk *ur_in;		/* blocks read ahead, in file order */
+  struct ioblk *ur_inlast;
+  struct ioblk *ur_out;		/* blocks of output staged or in flight */
+  struct ioblk *ur_outlast;
+  int ur_nin;
+  int ur_nout;
+  off_t ur_inoff;		/* offset of the next block to read */
+  off_t ur_outoff;		/* offset of the next byte of output */
+  size_t ur_outbytes;		/* output not yet written */
+#endif /* URING */
+
   struct conn *next;		/* Linked list of connections */
   struct conn **prev;
 };
@@ -262,9 +378,22 @@ typedef struct conn conn_t;
  * NULL conn_t. */
 conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
 
-/* Call this function to send a UDP packet to the other side. */
+/* Get a packet buffer from the connection's pool, and give it back.
+ * Use these instead of malloc for packets on the data path. */
+packet_t *conn_pktalloc (conn_t *c);
+void conn_pktfree (conn_t *c, packet_t *pkt);
+
+/* Call this function to send a UDP packet to the other side.  The
+ * packet is copied, so pkt may be reused or freed on return, and goes
+ * out with the others sent in the same pass of the event loop.  Returns
+ * len, or -1 if the socket is too backed up to take it, in which case
+ * the packet is lost as it would be on the network. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
+/* Arm the connection's timer to fire at CLOCK_MONOTONIC time *when,
+ * replacing any earlier deadline, or disarm it if when is NULL. */
+void conn_set_timer (conn_t *c, const struct timespec *when);
+
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
  * to return 0 if you write less than this many bytes. */
@@ -298,9 +427,12 @@ rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
 		   const struct config_common *);
 void rel_destroy (rel_t *);
 
-/* This function gets called on clients, when packets arrive: */
+/* This function gets called on clients, when packets arrive.  pkt
+ * comes from the connection's pool and is now yours: keep it, or give
+ * it back with conn_pktfree. */
 void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
-/* This function gets called on servers, when packets arrive: */
+/* This function gets called on servers, when packets arrive.  pkt is
+ * only valid for the duration of the call. */
 void rel_demux (const struct config_common *cc,
 		const struct sockaddr_storage *client,
 		packet_t *pkt, size_t len);
@@ -308,7 +440,7 @@ void rel_demux (const struct config_common *cc,
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (rel_t *);  /* Invoked when the conn_set_timer deadline passes */
 
 
 
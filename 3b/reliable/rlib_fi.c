@@ -0,0 +1,1549 @@
+/* rlib version 4 */
+
+#define _GNU_SOURCE		/* for sendmmsg and recvmmsg */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <assert.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "rlib.h"
+static unsigned long fi_calls, fi_eagain, fi_partial;
+static int
+fi_sendmmsg (int fd, struct mmsghdr *m, unsigned int n, int flags)
+{
+  fi_calls++;
+  if (fi_calls % 5 == 0) { fi_eagain++; errno = EAGAIN; return -1; }
+  if (fi_calls % 3 == 0 && n > 1) { fi_partial++; n /= 2; }
+  return sendmmsg (fd, m, n, flags);
+}
+#define sendmmsg fi_sendmmsg
+static unsigned long fi_rcalls;
+static int
+fi_recvmmsg (int fd, struct mmsghdr *m, unsigned int n, int flags, struct timespec *t)
+{
+  if (++fi_rcalls % 4 == 0) n = 1;
+  return recvmmsg (fd, m, n, flags, t);
+}
+#define recvmmsg fi_recvmmsg
+
+char *progname;
+int opt_debug;
+int log_in = -1;
+int log_out = -1;
+
+/*******add by xin*******/
+int infile = 0;
+int outfile = 0;
+/************************/
+
+struct config_client {
+  struct config_common c;
+  int listen_socket; 		/* Accept TCP connections on this socket */
+  struct sockaddr_storage server; /* Tunnel them to this server over UDP */
+};
+
+struct config_server {
+  struct config_common c;
+  int udp_socket;		/* Receive all UDP over this socket */
+  struct sockaddr_storage dest;	/* Demultiplex traffic and relay it to
+				   individual TCP connections to this
+				   address */
+};
+
+static struct config_server *serverconf;
+
+/* The event loop watches file descriptors with epoll, and only looks
+ * at the connections that something happened to: those epoll reports
+ * ready, and those on the dirty list, whose watches or send queues
+ * changed since conn_poll last brought them up to date.  A watch holds
+ * the events epoll is watching for on a descriptor, or one of: */
+#define EV_UNWATCHED -1
+#define EV_DEAD -2		/* hung up or failed; watched no more */
+#define EV_FILE 0x40000000	/* epoll refuses regular files, which are
+				   always ready, as poll reports them */
+#define EVBATCH_MAX 64
+
+static int epfd = -1;
+static conn_t **evconns;	/* connection watching each fd, by fd */
+static int nevconns;
+static int nfiles;		/* watches flagged EV_FILE */
+static conn_t *conn_dirty;
+
+/* The listening socket of a client or the UDP socket of a server */
+static int mainfd = -1;
+static int mainwatch = EV_UNWATCHED;
+static int mainready;		/* set when conn_poll saw mainfd ready */
+
+
+static conn_t *conn_list;
+
+/* Armed connection timers, as a binary min-heap on timer_at.  The heap
+ * is 1-based so that a timer_idx of 0 can mean "not armed". */
+static conn_t **timerq;
+static int ntimerq;
+static int timerq_size;
+
+#if !DMALLOC
+void *
+xmalloc (size_t n)
+{
+  void *p = malloc (n);
+  if (!p) {
+    fprintf (stderr, "%s: out of memory allocating %d bytes\n",
+	     progname, (int) n);
+    abort ();
+  }
+  return p;
+}
+#endif /* !DMALLOC */
+
+#if NEED_CLOCK_GETTIME
+int
+clock_gettime (int id, struct timespec *tp)
+{
+  struct timeval tv;
+
+  switch (id) {
+  case CLOCK_REALTIME:
+  case CLOCK_MONOTONIC:		/* XXX */
+    if (gettimeofday (&tv, NULL) < 0)
+      return -1;
+    tp->tv_sec = tv.tv_sec;
+    tp->tv_nsec = tv.tv_usec * 1000;
+    return 0;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+}
+#endif /* NEED_CLOCK_GETTIME */
+
+void
+print_pkt (const packet_t *buf, const char *op, int n)
+{
+  static int pid = -1;
+  int saved_errno = errno;
+  if (pid == -1)
+    pid = getpid ();
+  if (n < 0) {
+    if (errno != EAGAIN)
+      fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
+  }
+  else if (n == 19) {
+    const struct ack_packet *ack = (const struct ack_packet *) buf;
+    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d, delay = %u, sack = %02x%02x%02x\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno), ntohl(buf->rwnd),
+	     ntohl (ack->delay), ack->sack[2], ack->sack[1], ack->sack[0]);
+  }
+  else if (n >= 16 && n < 19) {
+    const struct ack_packet *ack = (const struct ack_packet *) buf;
+    fprintf (stderr, "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, rwnd = %d, delay = %u\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno), ntohl(buf->rwnd),
+	     ntohl (ack->delay));
+  }
+  else if (n >= 20)
+    fprintf (stderr,
+	     "%5d %s(%3d): cksum = %04x, len = %04x, ack = %08x, seq = %08x, rwnd = %d, tsval = %u\n",
+	     pid, op, n, buf->cksum, ntohs (buf->len), ntohl (buf->ackno),
+	     ntohl (buf->seqno), ntohl(buf->rwnd), ntohl (buf->tsval));
+  else
+    fprintf (stderr, "%5d %s(%3d):\n", pid, op, n);
+  errno = saved_errno;
+}
+
+/* Brings the watch on fd up to date with the events wanted, a mask of
+ * EPOLLIN and EPOLLOUT or EV_UNWATCHED.  epoll still reports errors and
+ * hangups on a descriptor watched for no events. */
+static void
+ev_watch (conn_t *c, int fd, int *watch, int want)
+{
+  struct epoll_event ev;
+  int op;
+
+  if (*watch == want || *watch == EV_DEAD)
+    return;
+  if (*watch >= 0 && (*watch & EV_FILE)) {
+    if (want < 0)
+      nfiles--;
+    *watch = want < 0 ? want : EV_FILE | want;
+    return;
+  }
+
+  op = want < 0 ? EPOLL_CTL_DEL
+    : *watch < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = want < 0 ? 0 : want;
+  ev.data.fd = fd;
+  if (epoll_ctl (epfd, op, fd, &ev) < 0) {
+    if (op == EPOLL_CTL_ADD && errno == EPERM) {
+      nfiles++;
+      *watch = EV_FILE | want;
+      return;
+    }
+    if (op != EPOLL_CTL_DEL)
+      perror ("epoll_ctl");
+  }
+  if (op == EPOLL_CTL_ADD) {
+    if (fd >= nevconns) {
+      int n = nevconns ? nevconns : 64;
+      while (n <= fd)
+	n *= 2;
+      evconns = realloc (evconns, n * sizeof (*evconns));
+      if (!evconns) {
+	fprintf (stderr, "%s: out of memory\n", progname);
+	abort ();
+      }
+      memset (evconns + nevconns, 0, (n - nevconns) * sizeof (*evconns));
+      nevconns = n;
+    }
+    evconns[fd] = c;
+  }
+  else if (op == EPOLL_CTL_DEL && fd < nevconns)
+    evconns[fd] = NULL;
+  *watch = want;
+}
+
+/* Sets the watches on a connection's descriptors to what it wants now. */
+static void
+conn_watch (conn_t *c)
+{
+  int rwant, wwant;
+
+  rwant = c->read_eof ? EV_UNWATCHED
+    : c->xoff || c->delete_me ? 0 : EPOLLIN;
+  wwant = c->write_err ? EV_UNWATCHED : c->outq ? EPOLLOUT : 0;
+  if (c->wfd == c->rfd) {
+    if (rwant < 0)
+      rwant = wwant;
+    else if (wwant > 0)
+      rwant |= wwant;
+  }
+  else
+    ev_watch (c, c->wfd, &c->wwatch, wwant);
+  ev_watch (c, c->rfd, &c->rwatch, rwant);
+  if (!c->server)
+    ev_watch (c, c->nfd, &c->nwatch, EPOLLIN | (c->ntxq ? EPOLLOUT : 0));
+}
+
+/* Puts c on the dirty list, for conn_poll to send its queued packets,
+ * update its watches, or free it once deleted. */
+static void
+conn_touch (conn_t *c)
+{
+  if (c->dirty)
+    return;
+  c->dirty = 1;
+  c->dirty_next = conn_dirty;
+  conn_dirty = c;
+}
+
+/* Sets up the event loop, watching mainfd if it is not -1. */
+static void
+ev_init (int fd)
+{
+  struct epoll_event ev;
+
+  if ((epfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+    perror ("epoll_create1");
+    exit (1);
+  }
+  /* Do catch errors on stderr, unless it is a file */
+  memset (&ev, 0, sizeof (ev));
+  ev.data.fd = 2;
+  epoll_ctl (epfd, EPOLL_CTL_ADD, 2, &ev);
+  mainfd = fd;
+  if (mainfd >= 0)
+    ev_watch (NULL, mainfd, &mainwatch, EPOLLIN);
+}
+
+union gsoctl {
+  char buf[CMSG_SPACE (sizeof (uint16_t))];
+  struct cmsghdr align;
+};
+
+/* Lays out the queued packets from the from'th on as messages for
+ * sendmmsg, starting at msgs.  With GSO, a run of packets of one size,
+ * and a shorter packet that may end it, make up one message.  Returns
+ * the number of messages. */
+static int
+conn_txmsgs (conn_t *c, int from, struct mmsghdr *msgs, struct iovec *iov,
+	     union gsoctl *ctl)
+{
+  struct cmsghdr *cm;
+  int i, m;
+
+  for (i = from, m = 0; i < c->ntxq; m++) {
+    int start = i++;
+    if (c->gso) {
+      while (i < c->ntxq && i - start < GSO_SEGS_MAX
+	     && c->txlen[i] == c->txlen[start])
+	i++;
+      if (i < c->ntxq && i - start < GSO_SEGS_MAX
+	  && c->txlen[i] < c->txlen[start])
+	i++;
+    }
+    memset (&msgs[m], 0, sizeof (msgs[m]));
+    msgs[m].msg_hdr.msg_iov = &iov[start];
+    msgs[m].msg_hdr.msg_iovlen = i - start;
+    if (c->server) {
+      msgs[m].msg_hdr.msg_name = &c->peer;
+      msgs[m].msg_hdr.msg_namelen = addrsize (&c->peer);
+    }
+    if (i - start > 1) {
+      msgs[m].msg_hdr.msg_control = ctl[m].buf;
+      msgs[m].msg_hdr.msg_controllen = sizeof (ctl[m].buf);
+      cm = CMSG_FIRSTHDR (&msgs[m].msg_hdr);
+      cm->cmsg_level = SOL_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN (sizeof (uint16_t));
+      *(uint16_t *) CMSG_DATA (cm) = c->txlen[start];
+    }
+  }
+  return m;
+}
+
+/* Sends the queued packets with as few sendmmsg calls as the socket
+ * allows.  Whatever it will not take yet stays queued, and conn_poll
+ * watches the socket for EPOLLOUT to try again. */
+static void
+conn_flush (conn_t *c)
+{
+  struct mmsghdr msgs[TXBATCH_MAX];
+  struct iovec iov[TXBATCH_MAX];
+  union gsoctl ctl[TXBATCH_MAX];
+  int i, k, m, n, nmsgs, sent = 0;
+
+  if (!c->ntxq)
+    return;
+  for (i = 0; i < c->ntxq; i++) {
+    iov[i].iov_base = c->txq[i];
+    iov[i].iov_len = c->txlen[i];
+  }
+  nmsgs = conn_txmsgs (c, 0, msgs, iov, ctl);
+
+  for (m = 0; m < nmsgs; m += n) {
+    n = sendmmsg (c->nfd, msgs + m, nmsgs - m, 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	break;
+      /* The route cannot segment, say for want of checksum offload, so
+       * go back to one datagram per packet. */
+      if ((errno == EIO || errno == EINVAL)
+	  && msgs[m].msg_hdr.msg_controllen) {
+	c->gso = 0;
+	nmsgs = m + conn_txmsgs (c, sent, msgs + m, iov, ctl + m);
+	n = 0;
+	continue;
+      }
+      /* An error for this message, such as ICMP port unreachable from
+       * the peer.  Its packets are lost, as lone sends would have lost
+       * them. */
+      if (opt_debug)
+	print_pkt (c->txq[sent], "send", -1);
+      sent += msgs[m].msg_hdr.msg_iovlen;
+      n = 1;
+      continue;
+    }
+    for (i = m; i < m + n; i++)
+      for (k = 0; k < (int) msgs[i].msg_hdr.msg_iovlen; k++, sent++)
+	if (opt_debug)
+	  print_pkt (c->txq[sent], "send", c->txlen[sent]);
+  }
+
+  for (i = 0; i < sent; i++)
+    conn_pktfree (c, c->txq[i]);
+  c->ntxq -= sent;
+  memmove (c->txq, c->txq + sent, c->ntxq * sizeof (c->txq[0]));
+  memmove (c->txlen, c->txlen + sent, c->ntxq * sizeof (c->txlen[0]));
+}
+
+int
+conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
+{
+  packet_t *copy;
+
+  assert (!c->delete_me);
+  if (c->ntxq == TXBATCH_MAX)
+    conn_flush (c);
+  if (c->ntxq == TXBATCH_MAX) {
+    errno = EAGAIN;
+    return -1;
+  }
+  copy = conn_pktalloc (c);
+  memcpy (copy, pkt, len);
+  c->txq[c->ntxq] = copy;
+  c->txlen[c->ntxq++] = len;
+  conn_touch (c);
+  return len;
+}
+
+packet_t *
+conn_pktalloc (conn_t *c)
+{
+  packet_t *pkt;
+  struct pktchunk *pc;
+  int i;
+
+  if (!c->pool_free) {
+    if (posix_memalign ((void **) &pc, 64, sizeof (*pc))) {
+      fprintf (stderr, "%s: out of memory allocating %d bytes\n",
+	       progname, (int) sizeof (*pc));
+      abort ();
+    }
+    pc->next = c->pool_chunks;
+    c->pool_chunks = pc;
+    c->pool_nchunks++;
+    for (i = PKTPOOL_CHUNK - 1; i >= 0; i--)
+      conn_pktfree (c, (packet_t *) (pc->slots + i * PKTPOOL_SLOT));
+  }
+
+  pkt = c->pool_free;
+  c->pool_free = *(packet_t **) pkt;
+  c->pool_nallocs++;
+  return pkt;
+}
+
+void
+conn_pktfree (conn_t *c, packet_t *pkt)
+{
+  *(packet_t **) pkt = c->pool_free;
+  c->pool_free = pkt;
+}
+
+size_t
+conn_bufspace (conn_t *c)
+{
+  chunk_t *ch;
+  size_t used = 0;
+  const size_t bufsize = 8192;
+
+
+  for (ch = c->outq; ch; ch = ch->next)
+    used += (ch->size - ch->used);
+  return used > bufsize ? 0 : bufsize - used;
+}
+
+int
+conn_output (conn_t *c, const void *_buf, size_t _n)
+{
+  const char *buf = _buf;
+  int n = _n;
+
+  assert (!c->delete_me && !c->write_eof);
+
+  if (n == 0) {
+    c->write_eof = 1;
+    if (!c->outq)
+    {
+      close(outfile);
+      shutdown (c->wfd, SHUT_WR);
+    }
+    return 0;
+  }
+
+  if (c->write_err) {
+    if (c->write_err == 2)
+      fprintf (stderr, "conn_output: attempt to write after error\n");
+    c->write_err = 2;
+    return -1;
+  }
+
+  if (!conn_bufspace (c))
+    return 0;
+
+  if (log_out >= 0)
+    write (log_out, buf, n);
+
+  if (!c->outq) {
+    int r = write (c->wfd, buf, n);
+    if (r < 0) {
+      if (errno != EAGAIN) {
+	perror ("write");
+	c->write_err = 2;
+	return -1;
+      }
+    }
+    else {
+      buf += r;
+      n -= r;
+    }
+  }
+
+  if (n > 0) {
+    chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
+    ch->next = NULL;
+    ch->size = n;
+    ch->used = 0;
+    memcpy (ch->buf, buf, n);
+    *c->outqtail = ch;
+    c->outqtail = &ch->next;
+  }
+
+  if (c->outq)
+    conn_touch (c);
+  return _n;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t n)
+{
+  int r;
+  assert (!c->delete_me);
+
+  if (c->read_eof)
+    return -1;
+  r = read (c->rfd, buf, n);
+  if (r == 0 || (r < 0 && errno != EAGAIN)) {
+    if (r == 0)
+      errno = EIO;
+    r = -1;
+    c->read_eof = 1;
+    conn_touch (c);
+    return r;
+  }
+  if (r < 0 && errno == EAGAIN)
+    r = 0;
+
+  if (r > 0 && log_in >= 0)
+    write (log_in, buf, r);
+
+  c->xoff = 0;
+  conn_touch (c);
+  if(r < 0)
+    close(infile);
+  return r;
+}
+
+static conn_t *
+conn_alloc (void)
+{
+  conn_t *c = xmalloc (sizeof (*c));
+  memset (c, 0, sizeof (*c));
+  c->prev = &conn_list;
+  c->next = conn_list;
+  c->outqtail = &c->outq;
+  if (conn_list)
+    conn_list->prev = &c->next;
+  conn_list = c;
+
+  c->rwatch = c->wwatch = c->nwatch = EV_UNWATCHED;
+  conn_touch (c);
+
+  return c;
+}
+
+/* Turns on UDP segmentation offload for c, as far as the kernel
+ * supports it.  Server connections share one socket, which conn_demux
+ * reads without GRO. */
+static void
+conn_offload (conn_t *c)
+{
+  int val = 1;
+  socklen_t len = sizeof (val);
+
+  c->gso = getsockopt (c->nfd, SOL_UDP, UDP_SEGMENT, &val, &len) == 0;
+  val = 1;
+  c->gro = !c->server
+    && setsockopt (c->nfd, SOL_UDP, UDP_GRO, &val, sizeof (val)) == 0;
+  if (opt_debug)
+    fprintf (stderr, "%5d UDP GSO %s, GRO %s\n", getpid (),
+	     c->gso ? "on" : "unsupported",
+	     c->server ? "off" : c->gro ? "on" : "unsupported");
+}
+
+conn_t *
+conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+{
+  int n;
+  conn_t *c;
+
+  /* conn_create is only when the program is running as a server (and
+   * rel_recvpkt is called with NULL packets.  If you call conn_create
+   * in the client, you will see this assertion fail. */
+  assert (serverconf);
+
+  if ((n = connect_to (0, &serverconf->dest)) < 0) {
+    char addr[NI_MAXHOST] = "unknown";
+    char port[NI_MAXSERV] = "unknown";
+    int saved_errno = errno;
+    getnameinfo ((const struct sockaddr *) &serverconf->dest,
+		 sizeof (serverconf->dest),
+		 addr, sizeof (addr), port, sizeof (port),
+		 NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
+    fprintf (stderr, "%s:%s: connect: %s\n",
+	     addr, port, strerror (saved_errno));
+    return NULL;
+  }
+
+  c = conn_alloc ();
+  c->peer = *ss;
+  c->rel = rel;
+  c->nfd = serverconf->udp_socket;
+  c->rfd = c->wfd = n;
+  c->server = 1;
+  if (serverconf->c.gso)
+    conn_offload (c);
+
+  return c;
+}
+
+static void
+conn_free (conn_t *c)
+{
+  chunk_t *ch, *nch;
+  struct pktchunk *pc, *npc;
+
+  fprintf (stderr, "FI %lu calls %lu eagain %lu partial\n", fi_calls, fi_eagain, fi_partial);
+  for (ch = c->outq; ch; ch = nch) {
+    nch = ch->next;
+    free (ch);
+  }
+  for (pc = c->pool_chunks; pc; pc = npc) {
+    npc = pc->next;
+    free (pc);
+  }
+
+  if (c->next)
+    c->next->prev = c->prev;
+  *c->prev = c->next;
+
+  ev_watch (c, c->rfd, &c->rwatch, EV_UNWATCHED);
+  if (c->wfd != c->rfd)
+    ev_watch (c, c->wfd, &c->wwatch, EV_UNWATCHED);
+  if (!c->server)
+    ev_watch (c, c->nfd, &c->nwatch, EV_UNWATCHED);
+  close (c->rfd);
+  if (c->wfd != c->rfd)
+    close (c->wfd);
+  if (!c->server)
+    close (c->nfd);
+  conn_set_timer (c, NULL);
+  close(infile);
+  close(outfile);
+
+  /* to help catch errors */
+  memset (c, 0xc5, sizeof (*c));
+  free (c);
+}
+
+void
+conn_destroy (conn_t *c)
+{
+  c->delete_me = 1;
+  conn_set_timer (c, NULL);
+  conn_touch (c);
+}
+
+void
+conn_drain (conn_t *c)
+{
+  chunk_t *ch;
+  int didsome = 0;
+
+  conn_touch (c);
+  if (c->write_err)
+    return;
+
+  while ((ch = c->outq)) {
+    int n = write (c->wfd, ch->buf + ch->used,
+		   ch->size - ch->used);
+    if (n < 0) {
+      if (errno != EAGAIN)
+	c->write_err = 1;
+      break;
+    }
+    didsome = 1;
+    ch->used += n;
+    if (ch->used < ch->size)
+      break;
+    c->outq = ch->next;
+    if (!c->outq)
+      c->outqtail = &c->outq;
+    free (ch);
+  }
+  if (c->write_eof && !c->write_err && !c->outq) {
+    c->write_err = 1;
+    shutdown (c->wfd, SHUT_WR);
+  }
+  if (didsome && !c->delete_me)
+    rel_output (c->rel);
+}
+
+static void
+conn_demux (const struct config_server *cs)
+{
+  static packet_t pkts[RXBATCH_MAX];
+  struct sockaddr_storage ss[RXBATCH_MAX];
+  struct mmsghdr msgs[RXBATCH_MAX];
+  struct iovec iov[RXBATCH_MAX];
+  int i, n;
+
+  for (i = 0; i < RXBATCH_MAX; i++) {
+    iov[i].iov_base = &pkts[i];
+    iov[i].iov_len = sizeof (pkts[i]);
+  }
+  for (;;) {
+    memset (msgs, 0, sizeof (msgs));
+    for (i = 0; i < RXBATCH_MAX; i++) {
+      msgs[i].msg_hdr.msg_name = &ss[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof (ss[i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    memset (ss, 0, sizeof (ss));
+    n = recvmmsg (cs->udp_socket, msgs, RXBATCH_MAX, 0, NULL);
+    if (n < 0)
+      break;
+    for (i = 0; i < n; i++) {
+      if (opt_debug)
+	print_pkt (&pkts[i], "recv", msgs[i].msg_len);
+      rel_demux (&cs->c, &ss[i], &pkts[i], msgs[i].msg_len);
+      memset (&pkts[i], 0xc7, msgs[i].msg_len);	/* to help debugging */
+      memset (&ss[i], 0x7c, sizeof (ss[i]));	/* to help debugging */
+    }
+  }
+  if (errno != EAGAIN)
+    perror ("UDP recv");
+}
+
+/* Copies len bytes from offset off into the buffers of iov. */
+static void
+iov_gather (const struct iovec *iov, size_t off, void *dst, size_t len)
+{
+  size_t k;
+
+  for (; off >= iov->iov_len; iov++)
+    off -= iov->iov_len;
+  for (; len; iov++, off = 0) {
+    k = iov->iov_len - off < len ? iov->iov_len - off : len;
+    memcpy (dst, (char *) iov->iov_base + off, k);
+    dst = (char *) dst + k;
+    len -= k;
+  }
+}
+
+/* Like conn_recv, but for a socket with UDP_GRO on, where one datagram
+ * may be a burst of segments glued together.  The pool packets it reads
+ * into are cut to the segment size the last burst had, so that each
+ * segment of the next lands in a packet of its own; segments that do
+ * not, or that spill past them, are copied out. */
+static void
+conn_recvgro (conn_t *c)
+{
+  static char spill[65536];
+  struct iovec iov[RXBATCH_MAX + 1];
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } ctl;
+  struct msghdr mh;
+  struct cmsghdr *cm;
+  size_t seg, slot, off, len;
+  packet_t *pkt;
+  ssize_t n;
+  int i;
+
+  slot = c->gro_seg ? c->gro_seg : sizeof (packet_t);
+  for (i = 0; i < RXBATCH_MAX; i++) {
+    if (!c->rxq[i])
+      c->rxq[i] = conn_pktalloc (c);
+    iov[i].iov_base = c->rxq[i];
+    iov[i].iov_len = slot;
+  }
+  iov[i].iov_base = spill;
+  iov[i].iov_len = sizeof (spill);
+  memset (&mh, 0, sizeof (mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = RXBATCH_MAX + 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof (ctl.buf);
+  n = recvmsg (c->nfd, &mh, 0);
+  if (n < 0) {
+    if (opt_debug)
+      print_pkt (NULL, "recv", n);
+    if (errno != EAGAIN)
+      perror ("recv");
+    return;
+  }
+
+  seg = n;
+  for (cm = CMSG_FIRSTHDR (&mh); cm; cm = CMSG_NXTHDR (&mh, cm))
+    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+      seg = *(int *) CMSG_DATA (cm);
+  if (seg < (size_t) n && seg <= sizeof (packet_t))
+    c->gro_seg = seg;
+
+  for (off = 0; off < (size_t) n; off += seg) {
+    len = (size_t) n - off < seg ? (size_t) n - off : seg;
+    if (off % slot == 0 && off / slot < RXBATCH_MAX && len <= slot) {
+      pkt = c->rxq[off / slot];
+      c->rxq[off / slot] = NULL;
+    }
+    else {
+      if (len > sizeof (packet_t))
+	len = sizeof (packet_t);
+      pkt = conn_pktalloc (c);
+      iov_gather (iov, off, pkt, len);
+    }
+    if (opt_debug)
+      print_pkt (pkt, "recv", len);
+    if (c->delete_me)
+      conn_pktfree (c, pkt);
+    else
+      rel_recvpkt (c->rel, pkt, len);
+  }
+}
+
+/* Take what has arrived on a client connection's socket with one
+ * recvmmsg, straight into packets from its pool, and hand each one over
+ * to rel_recvpkt, so that the packets they prompt go out together. */
+static void
+conn_recv (conn_t *c)
+{
+  struct mmsghdr msgs[RXBATCH_MAX];
+  struct iovec iov[RXBATCH_MAX];
+  packet_t *pkt;
+  int i, n;
+
+  if (c->gro) {
+    conn_recvgro (c);
+    return;
+  }
+  memset (msgs, 0, sizeof (msgs));
+  for (i = 0; i < RXBATCH_MAX; i++) {
+    if (!c->rxq[i])
+      c->rxq[i] = conn_pktalloc (c);
+    iov[i].iov_base = c->rxq[i];
+    iov[i].iov_len = sizeof (packet_t);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  n = recvmmsg (c->nfd, msgs, RXBATCH_MAX, 0, NULL);
+  if (n < 0) {
+    if (opt_debug)
+      print_pkt (NULL, "recv", n);
+    if (errno != EAGAIN)
+      perror ("recv");
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    pkt = c->rxq[i];
+    c->rxq[i] = NULL;
+    if (opt_debug)
+      print_pkt (pkt, "recv", msgs[i].msg_len);
+    if (c->delete_me)
+      conn_pktfree (c, pkt);
+    else
+      rel_recvpkt (c->rel, pkt, msgs[i].msg_len);
+  }
+}
+
+static int
+timespec_before (const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec < b->tv_sec
+    || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void
+timerq_place (conn_t *c, int i)
+{
+  timerq[i] = c;
+  c->timer_idx = i;
+}
+
+/* Restore the heap property for the entry at position i */
+static void
+timerq_fix (int i)
+{
+  conn_t *c = timerq[i];
+  int child;
+
+  while (i > 1 && timespec_before (&c->timer_at, &timerq[i / 2]->timer_at)) {
+    timerq_place (timerq[i / 2], i);
+    i /= 2;
+  }
+  while ((child = 2 * i) <= ntimerq) {
+    if (child < ntimerq
+	&& timespec_before (&timerq[child + 1]->timer_at,
+			    &timerq[child]->timer_at))
+      child++;
+    if (!timespec_before (&timerq[child]->timer_at, &c->timer_at))
+      break;
+    timerq_place (timerq[child], i);
+    i = child;
+  }
+  timerq_place (c, i);
+}
+
+void
+conn_set_timer (conn_t *c, const struct timespec *when)
+{
+  int i = c->timer_idx;
+
+  if (!when) {
+    if (!i)
+      return;
+    c->timer_idx = 0;
+    if (i != ntimerq--) {
+      timerq[i] = timerq[ntimerq + 1];
+      timerq_fix (i);
+    }
+    return;
+  }
+
+  c->timer_at = *when;
+  if (!i) {
+    if (ntimerq + 1 >= timerq_size) {
+      timerq_size = timerq_size ? 2 * timerq_size : 16;
+      timerq = realloc (timerq, timerq_size * sizeof (*timerq));
+      if (!timerq) {
+	fprintf (stderr, "%s: out of memory\n", progname);
+	abort ();
+      }
+    }
+    i = ++ntimerq;
+  }
+  timerq_place (c, i);
+  timerq_fix (i);
+}
+
+/* Handles what epoll reported for fd, watched by c. */
+static void
+conn_event (conn_t *c, int fd, uint32_t events,
+	    const struct config_common *cc)
+{
+  if ((events & (EPOLLIN|EPOLLERR|EPOLLHUP)) && !c->delete_me) {
+    if (fd == c->rfd) {
+      c->xoff = 1;
+      conn_touch (c);
+      rel_read (c->rel);
+    }
+    else if (fd == c->nfd && (events & (EPOLLERR|EPOLLHUP))) {
+      char addr[NI_MAXHOST] = "unknown";
+      char port[NI_MAXSERV] = "unknown";
+      getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+		   addr, sizeof (addr), port, sizeof (port),
+		   NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+      fprintf (stderr, "[received ICMP port unreachable;"
+	       " assuming peer at %s:%s is dead]\n", addr, port);
+      if (cc->single_connection)
+	exit (1);
+      rel_destroy (c->rel);
+    }
+    else if (fd == c->nfd && !c->server)
+      conn_recv (c);
+  }
+  if ((events & (EPOLLOUT|EPOLLHUP|EPOLLERR)) && fd == c->wfd)
+    conn_drain (c);
+  if ((events & EPOLLOUT) && fd == c->nfd)
+    conn_touch (c);
+  if (events & (EPOLLHUP|EPOLLERR)) {
+#if 0
+    fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
+	     getpid (), fd, events);
+#endif
+    if (fd == c->rfd)
+      ev_watch (c, fd, &c->rwatch, EV_DEAD);
+    else if (fd == c->wfd)
+      ev_watch (c, fd, &c->wwatch, EV_DEAD);
+    else if (fd == c->nfd)
+      ev_watch (c, fd, &c->nwatch, EV_DEAD);
+  }
+}
+
+void
+conn_poll (const struct config_common *cc)
+{
+  static struct epoll_event evs[EVBATCH_MAX];
+  static int have_pwait2 = 1;
+  int i, n, fileready = 0, mainout = 0, freed = 0;
+  conn_t *c, *nc;
+  struct timespec now, wait, *waitp = NULL;
+
+  /* Send what the last pass queued and bring the watches of the
+   * connections that changed up to date.  One whose socket could not
+   * take all its packets gets watched for EPOLLOUT, or stays dirty when
+   * it shares the server's socket.  A deleted connection stays dirty
+   * until its output and its last packets are out, and then goes,
+   * without a sleep, so that the caller sees it gone. */
+  for (c = conn_dirty, conn_dirty = NULL; c; c = nc) {
+    nc = c->dirty_next;
+    c->dirty = 0;
+    conn_flush (c);
+    if (c->delete_me && (c->write_err || !c->outq) && !c->ntxq) {
+      conn_free (c);
+      freed = 1;
+      continue;
+    }
+    if (c->delete_me || (c->server && c->ntxq))
+      conn_touch (c);
+    if (c->server && c->ntxq)
+      mainout = 1;
+    conn_watch (c);
+  }
+  if (mainfd >= 0)
+    ev_watch (NULL, mainfd, &mainwatch, EPOLLIN | (mainout ? EPOLLOUT : 0));
+  mainready = 0;
+  if (freed)
+    return;
+
+  /* Regular files are always ready for what they are watched for.  Only
+   * stand-alone mode has them, with its one connection. */
+  if (nfiles)
+    for (c = conn_list; c; c = c->next)
+      if ((c->rwatch >= 0 && (c->rwatch & EV_FILE) && (c->rwatch & EPOLLIN))
+	  || (c->wwatch >= 0 && (c->wwatch & EV_FILE)
+	      && (c->wwatch & EPOLLOUT)))
+	fileready = 1;
+
+  /* Sleep until the earliest timer deadline, or indefinitely if no
+   * timer is armed. */
+  if (ntimerq) {
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    wait.tv_sec = timerq[1]->timer_at.tv_sec - now.tv_sec;
+    wait.tv_nsec = timerq[1]->timer_at.tv_nsec - now.tv_nsec;
+    if (wait.tv_nsec < 0) {
+      wait.tv_sec--;
+      wait.tv_nsec += 1000000000;
+    }
+    if (wait.tv_sec < 0)
+      wait.tv_sec = wait.tv_nsec = 0;
+    waitp = &wait;
+  }
+  if (fileready) {
+    wait.tv_sec = wait.tv_nsec = 0;
+    waitp = &wait;
+  }
+
+  /* Kernels before 5.11 lack epoll_pwait2, and sleep to the millisecond,
+   * rounded up. */
+  n = -1;
+  if (have_pwait2) {
+    n = epoll_pwait2 (epfd, evs, EVBATCH_MAX, waitp, NULL);
+    if (n < 0 && errno == ENOSYS)
+      have_pwait2 = 0;
+  }
+  if (!have_pwait2)
+    n = epoll_wait (epfd, evs, EVBATCH_MAX,
+		    !waitp ? -1 : waitp->tv_sec * 1000
+		    + (waitp->tv_nsec + 999999) / 1000000);
+
+  for (i = 0; i < n; i++) {
+    int fd = evs[i].data.fd;
+    if (fd == mainfd)
+      mainready = (evs[i].events & ~EPOLLOUT) != 0;
+    else if (fd == 2) {
+      /* If stderr has an error, the tester has probably died, so exit
+       * immediately. */
+      if (evs[i].events & (EPOLLHUP|EPOLLERR))
+	exit (1);
+    }
+    else if (fd < nevconns && (c = evconns[fd]))
+      conn_event (c, fd, evs[i].events, cc);
+  }
+  if (fileready)
+    for (c = conn_list; c; c = c->next) {
+      if (c->rwatch >= 0 && (c->rwatch & EV_FILE) && (c->rwatch & EPOLLIN))
+	conn_event (c, c->rfd, EPOLLIN, cc);
+      if (c->wwatch >= 0 && (c->wwatch & EV_FILE) && (c->wwatch & EPOLLOUT))
+	conn_event (c, c->wfd, EPOLLOUT, cc);
+    }
+
+  /* Fire expired timers.  rel_timer may re-arm, but only for a time
+   * after now, so this only visits connections that are due. */
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  while (ntimerq && !timespec_before (&now, &timerq[1]->timer_at)) {
+    c = timerq[1];
+    conn_set_timer (c, NULL);
+    if (!c->delete_me)
+      rel_timer (c->rel);
+  }
+}
+
+uint16_t
+cksum (const void *_data, int len)
+{
+  const uint8_t *data = _data;
+  uint32_t sum;
+
+  for (sum = 0;len >= 2; data += 2, len -= 2)
+    sum += data[0] << 8 | data[1];
+  if (len > 0)
+    sum += data[0] << 8;
+  while (sum > 0xffff)
+    sum = (sum >> 16) + (sum & 0xffff);
+  sum = htons (~sum);
+  return sum ? sum : 0xffff;
+}
+
+int
+make_async (int s)
+{
+  int n;
+  if ((n = fcntl (s, F_GETFL)) < 0
+      || fcntl (s, F_SETFL, n | O_NONBLOCK) < 0)
+    return -1;
+  return 0;
+}
+
+int
+addreq (const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+  if (a->ss_family != b->ss_family)
+    return 0;
+  switch (a->ss_family) {
+  case AF_INET:
+    {
+      const struct sockaddr_in *aa = (const struct sockaddr_in *) a;
+      const struct sockaddr_in *bb = (const struct sockaddr_in *) b;
+      return (aa->sin_addr.s_addr == bb->sin_addr.s_addr
+	      && aa->sin_port == bb->sin_port);
+    }
+  case AF_INET6:
+    {
+      const struct sockaddr_in6 *aa = (const struct sockaddr_in6 *) a;
+      const struct sockaddr_in6 *bb = (const struct sockaddr_in6 *) b;
+      return (!memcmp (&aa->sin6_addr, &bb->sin6_addr, sizeof (aa->sin6_addr))
+	      && aa->sin6_port == bb->sin6_port);
+    }
+  case AF_UNIX:
+    {
+      const struct sockaddr_un *aa = (const struct sockaddr_un *) a;
+      const struct sockaddr_un *bb = (const struct sockaddr_un *) b;
+      return !strcmp (aa->sun_path, bb->sun_path);
+    }
+  }
+  fprintf (stderr, "addrhash: unknown address family %d\n",
+	   a->ss_family);
+  abort ();
+}
+
+size_t
+addrsize (const struct sockaddr_storage *ss)
+{
+  switch (ss->ss_family) {
+  case AF_INET:
+    return sizeof (struct sockaddr_in);
+  case AF_INET6:
+    return sizeof (struct sockaddr_in6);
+  case AF_UNIX:
+    return sizeof (struct sockaddr_un);
+  }
+  fprintf (stderr, "addrsize: unknown address family %d\n",
+	   ss->ss_family);
+  abort ();
+}
+
+static inline unsigned int
+hash_bytes (const void *_key, int len, unsigned int seed)
+{
+  const unsigned char *key = (const unsigned char *) _key;
+  const unsigned char *end;
+
+  for (end = key + len; key < end; key++)
+    seed = ((seed << 5) + seed) ^ *key;
+  return seed;
+}
+unsigned int
+addrhash (const struct sockaddr_storage *ss)
+{
+  unsigned int r = 5381;
+  switch (ss->ss_family) {
+  case AF_INET:
+    {
+      const struct sockaddr_in *s = (const struct sockaddr_in *) ss;
+      r = hash_bytes (&s->sin_port, 2, r);
+      return hash_bytes (&s->sin_addr, 4, r);
+    }
+  case AF_INET6:
+    {
+      const struct sockaddr_in6 *s = (const struct sockaddr_in6 *) ss;
+      r = hash_bytes (&s->sin6_port, 2, r);
+      return hash_bytes (&s->sin6_addr, 16, r);
+    }
+  case AF_UNIX:
+    {
+      const struct sockaddr_un *s = (const struct sockaddr_un *) ss;
+      return hash_bytes (s->sun_path, strlen (s->sun_path), r);
+    }
+  }
+  fprintf (stderr, "addrhash: unknown address family %d\n",
+	   ss->ss_family);
+  abort ();
+}
+
+int
+get_address (struct sockaddr_storage *ss, int local,
+	     int dgram, int family, char *name)
+{
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  int err;
+  char *host, *port;
+
+  memset (ss, 0, sizeof (*ss));
+
+  if (family == AF_UNIX) {
+    size_t len = strlen (name);
+    struct sockaddr_un *sun = (struct sockaddr_un *) ss;
+    if (offsetof (struct sockaddr_un, sun_path[len])
+	>= sizeof (struct sockaddr_storage)) {
+      fprintf (stderr, "%s: name too long\n", name);
+      return -1;
+    }
+    sun->sun_family = AF_UNIX;
+    strcpy (sun->sun_path, name);
+    return 0;
+  }
+
+  assert (family == AF_UNSPEC || family == AF_INET || family || AF_INET6);
+
+  if (name) {
+    host = strsep (&name, ":");
+    port = strsep (&name, ":");
+    if (!port) {
+      port = host;
+      host = NULL;
+    }
+  }
+  else {
+    host = NULL;
+    port = "0";
+  }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = family;
+  hints.ai_socktype = dgram ? SOCK_DGRAM : SOCK_STREAM;
+
+  if (local)
+    hints.ai_flags = AI_PASSIVE; /* passive means for local address */
+  err = getaddrinfo (host, port, &hints, &ai);
+  if (err) {
+    if (local)
+      fprintf (stderr, "local port %s: %s\n", port, gai_strerror (err));
+    else
+      fprintf (stderr, "%s:%s: %s\n", host ? host : "localhost",
+	       port, gai_strerror (err));
+    return -1;
+  }
+
+  assert (ai->ai_addrlen <= sizeof (*ss));
+  memcpy (ss, ai->ai_addr, ai->ai_addrlen);
+  freeaddrinfo (ai);
+  return 0;
+}
+
+int
+listen_on (int dgram, struct sockaddr_storage *ss)
+{
+  int type = dgram ? SOCK_DGRAM : SOCK_STREAM;
+  int s = socket (ss->ss_family, type, 0);
+  int n = 1;
+  socklen_t len;
+  int err;
+  char portname[NI_MAXSERV];
+
+  if (s < 0) {
+    perror ("socket");
+    return -1;
+  }
+  if (!dgram)
+    setsockopt (s, SOL_SOCKET, SO_REUSEADDR, (char *) &n, sizeof (n));
+  if (bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0) {
+    perror ("bind");
+    close (s);
+    return -1;
+  }
+  if (!dgram && listen (s, 10) < 0) {
+    perror ("listen");
+    close (s);
+    return -1;
+  }
+
+  if (ss->ss_family == AF_UNIX) {
+    fprintf (stderr, "[listening on %s]\n",
+	     ((struct sockaddr_un *) ss)->sun_path);
+    return s;
+  }
+
+  /* If bound port 0, kernel selectec port, so we need to read it back. */
+  len = sizeof (*ss);
+  if (getsockname (s, (struct sockaddr *) ss, &len) < 0) {
+    perror ("getsockname");
+    close (s);
+    return -1;
+  }
+  err = getnameinfo ((struct sockaddr *) ss, len, NULL, 0,
+		     portname, sizeof (portname), 
+		     (dgram ? NI_DGRAM : 0) | NI_NUMERICSERV);
+  if (err) {
+    fprintf (stderr, "%s\n", gai_strerror (err));
+    close (s);
+    return -1;
+  }
+
+  fprintf (stderr, "[listening on %s port %s]\n",
+	   dgram ? "UDP" : "TCP", portname);
+  return s;
+}
+
+int
+connect_to (int dgram, const struct sockaddr_storage *ss)
+{
+  int type = dgram ? SOCK_DGRAM : SOCK_STREAM;
+  int s = socket (ss->ss_family, type, 0);
+  if (s < 0) {
+    perror ("socket");
+    return -1;
+  }
+  make_async (s);
+  if (connect (s, (struct sockaddr *) ss, addrsize (ss)) < 0
+      && errno != EINPROGRESS) {
+    perror ("connect");
+    close (s);
+    return -1;
+  }
+
+  return s;
+}
+
+void
+do_client (struct config_client *cc)
+{
+  make_async (cc->listen_socket);
+  ev_init (cc->listen_socket);
+  for (;;) {
+    conn_poll (&cc->c);
+    if (mainready) {
+      struct sockaddr_storage ss;
+      socklen_t len = sizeof (ss);
+      int s, u;
+      conn_t *c;
+      errno = EINVAL;
+      s = accept (cc->listen_socket, (struct sockaddr *) &ss, &len);
+      if (s < 0 && errno != EAGAIN)
+	perror ("accept");
+      if (s < 0)
+	continue;
+      make_async (s);
+      if ((u = connect_to (1, &cc->server)) >= 0) {
+	c = conn_alloc ();
+	c->rfd = s;
+	c->wfd = s;
+	c->nfd = u;
+	c->peer = cc->server;
+	if (cc->c.gso)
+	  conn_offload (c);
+	c->rel = rel_create (c, NULL, &cc->c);
+	if (!c->rel)
+	  conn_destroy (c);
+      }
+      else
+	close (s);
+    }
+  }
+}
+
+void
+do_server (struct config_server *cs)
+{
+  serverconf = cs;
+  make_async (cs->udp_socket);
+  ev_init (cs->udp_socket);
+  for (;;) {
+    conn_poll (&cs->c);
+    if (mainready)
+      conn_demux (cs);
+  }
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+	   "usage: %s -s inputfile udp-port [relayer:]udp-port\n"
+           "       %s -r outputfile udp-port [relayer:]udp-port\n"
+           "       -w: RECEIVER's maximum receiving window size, in number of packets\n"
+           "       -b: SENDER's send buffer size, in number of packets\n"
+           "       -t: initial retransmission timeout, in milliseconds\n"
+           "       -m, -M: minimum and maximum retransmission timeout, in milliseconds\n"
+           "       -c, --cc: congestion control algorithm, reno, cubic, bbr or ledbat (default reno)\n"
+           "       -p, --pace: pace reno, cubic and ledbat at cwnd per RTT too\n"
+           "       -P, --pace-burst: most packets pacing sends back to back (default 1)\n"
+           "       -g, --gso: send and receive bursts of packets with UDP GSO and GRO\n"
+	   ,progname, progname);
+  exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct option o[] = {
+    { "debug", no_argument, NULL, 'd' },
+    { "window", required_argument, NULL, 'w' },
+    { "sender", required_argument, NULL, 's'},
+    { "receiver", required_argument, NULL, 'r'},
+    { "sndbuf", required_argument, NULL, 'b'},
+    { "timeout", required_argument, NULL, 't'},
+    { "rto-min", required_argument, NULL, 'm'},
+    { "rto-max", required_argument, NULL, 'M'},
+    { "cc", required_argument, NULL, 'c'},
+    { "pace", no_argument, NULL, 'p'},
+    { "pace-burst", required_argument, NULL, 'P'},
+    { "gso", no_argument, NULL, 'g'},
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+  char *local = NULL;
+  char *remote = NULL;
+  char *input = NULL;
+  char *output = NULL;
+  struct config_common c;
+  struct sigaction sa;
+
+  /* Ignore SIGPIPE, since we may get a lot of these */
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction (SIGPIPE, &sa, NULL);
+
+  memset (&c, 0, sizeof (c));
+  c.window = 25;
+  c.sndbuf = 4096;
+  c.timeout = 100;
+  c.rto_min = 20;
+  c.rto_max = 60000;
+  c.cc = "reno";
+  c.pace_burst = 1;
+  c.sender_receiver = RECEIVER; /* default, it is receiver*/
+
+  progname = strrchr (argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+
+  while ((opt = getopt_long (argc, argv, "ds:r:w:b:t:m:M:c:pP:g", o, NULL)) != -1)
+    switch (opt) {
+    case 'd':
+      opt_debug = 1;
+      break;
+    case 's':
+      c.sender_receiver = SENDER;
+      input = optarg;
+      break;
+    case 'r':
+      c.sender_receiver = RECEIVER;
+      output = optarg;
+      break;
+    case 'w': //receiver's largest receiving window size, the sender does not need this parameter.
+      c.window = atoi (optarg);
+      break;
+    case 'b': //sender's send buffer; input is not read further ahead of the acks than this
+      c.sndbuf = atoi (optarg);
+      break;
+    case 't':
+      c.timeout = atoi (optarg);
+      break;
+    case 'm':
+      c.rto_min = atoi (optarg);
+      break;
+    case 'M':
+      c.rto_max = atoi (optarg);
+      break;
+    case 'c':
+      c.cc = optarg;
+      break;
+    case 'p':
+      c.pace = 1;
+      break;
+    case 'P':
+      c.pace_burst = atoi (optarg);
+      break;
+    case 'g':
+      c.gso = 1;
+      break;
+    default:
+      usage ();
+      break;
+    }
+
+
+  if(optind + 2 != argc || c.window < 1 || c.sndbuf < 1
+     || c.timeout < 1 || c.rto_min < 1 || c.rto_max < c.rto_min
+     || c.pace_burst < 1)
+    usage ();
+
+  local = argv[optind];
+  remote = argv[optind+1];
+
+
+  struct sockaddr_storage sl, sr;
+  conn_t *cn = conn_alloc ();
+  c.single_connection = 1;
+  
+  if(c.sender_receiver == SENDER)
+  {
+    infile = open(input, O_RDONLY);
+    if(infile < 0)
+    {
+      fprintf(stderr, "input file open error\n");
+      exit (1);
+    }
+    cn->rfd = infile;
+    cn->wfd = STDOUT_FILENO;
+  }
+  else if(c.sender_receiver == RECEIVER)
+  {
+    cn->rfd = STDIN_FILENO;
+    outfile = open(output, O_RDWR|O_CREAT, S_IWRITE|S_IREAD);
+    if(outfile < 0)
+    {
+      fprintf(stderr, "output file open error\n");
+      exit (1);
+    }
+    cn->wfd = outfile;
+  }
+
+
+  if (get_address (&sr, 0, 1, AF_INET, remote) < 0
+      || get_address (&sl, 1, 1, sr.ss_family, local) < 0
+      || (cn->nfd = listen_on (1, &sl)) < 0)
+      exit (1);
+  if (connect (cn->nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) 
+  {
+    perror ("connect error");
+    exit (1);
+  }
+  cn->sender_receiver = c.sender_receiver;
+  cn->server = 0;
+  cn->peer = sr;
+  make_async (cn->rfd);
+  make_async (cn->wfd);
+  make_async (cn->nfd);
+  if (c.gso)
+    conn_offload (cn);
+  cn->rel = rel_create (cn, NULL, &c);
+  if (!cn->rel)
+    exit (1);
+
+  ev_init (-1);
+  while (conn_list)
+    conn_poll (&c);
+  return 0;
+}